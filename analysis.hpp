@@ -0,0 +1,100 @@
+#pragma once
+#ifndef _EXPORT
+#define _EXPORT
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <ranges>
+#include <string>
+#include <vector>
+
+#include "bot.hpp"
+#include "rule.hpp"
+
+// One line of ANALYSIS_RESULT_OP: a root move, how often it was searched, the chance that
+// it wins for the side to move and the expected continuation (starting with the move).
+_EXPORT struct AnalysisCandidate {
+    std::string move;
+    int visits;
+    double winrate;
+    std::vector<std::string> pv;
+
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE(AnalysisCandidate, move, visits, winrate, pv)
+};
+
+// The analysis search uses playout (or network) rewards, which are results in [-1, 1] for
+// the player who moved into a node.
+_EXPORT inline auto analysis_options(const State& state, chrono::milliseconds time_limit) -> MCTSOptions
+{
+    MCTSOptions options { .C = 1.5, .policy = LeafPolicy::PLAYOUT, .pattern_priors = true, .time_limit = time_limit };
+    if (value_network && value_network->rank == state.board->get_rank())
+        options.policy = LeafPolicy::NETWORK;
+    return options;
+}
+
+// the top_k most visited root moves, best first
+_EXPORT inline auto analyse(const MCTSNode& root, int top_k, int max_depth = 10) -> std::vector<AnalysisCandidate>
+{
+    using MCTSNode_ptr = MCTSNode::MCTSNode_ptr;
+    auto most_visited = [](const std::vector<MCTSNode_ptr>& children) {
+        return *ranges::max_element(children, std::less {}, [](auto& child) { return child->visit; });
+    };
+
+    std::vector<MCTSNode_ptr> children;
+    for (auto& child : root.children) {
+        if (child->visit > 0)
+            children.push_back(child);
+    }
+    top_k = std::min<int>(top_k, children.size());
+    std::ranges::partial_sort(children, children.begin() + top_k, std::greater {}, [](auto& child) { return child->visit; });
+
+    std::vector<AnalysisCandidate> candidates;
+    for (auto& child : children | std::views::take(top_k)) {
+        AnalysisCandidate candidate {
+            .move = child->state.last_move.to_string(),
+            .visits = child->visit,
+            .winrate = std::clamp((1 + child->quality / child->visit) / 2, 0.0, 1.0),
+            .pv = {},
+        };
+        for (auto node { child }; node && std::ssize(candidate.pv) < max_depth;
+             node = node->children.empty() ? nullptr : most_visited(node->children))
+            candidate.pv.push_back(node->state.last_move.to_string());
+        candidates.push_back(std::move(candidate));
+    }
+    return candidates;
+}
+
+// Throughput and shape of a running search, for UiMessage::Game::statistics.
+_EXPORT struct SearchTelemetry {
+    double iterations_per_second;
+    std::size_t tree_size; // nodes
+    std::optional<double> winrate; // for the side to move, unless rewards are not results
+    double confidence; // share of the root visits spent on the most visited move
+    chrono::milliseconds elapsed;
+
+    SearchTelemetry(const MCTSNode& root, chrono::milliseconds elapsed)
+        : iterations_per_second(elapsed.count() ? root.visit * 1000.0 / elapsed.count() : 0)
+        , tree_size(0)
+        , confidence(0)
+        , elapsed(elapsed)
+    {
+        std::vector<const MCTSNode*> stack { &root };
+        while (!stack.empty()) {
+            auto node { stack.back() };
+            stack.pop_back();
+            tree_size++;
+            for (auto& child : node->children)
+                stack.push_back(child.get());
+        }
+        if (root.options.policy != LeafPolicy::MOBILITY && root.visit)
+            winrate = std::clamp((1 - root.quality / root.visit) / 2, 0.0, 1.0);
+        for (auto& child : root.children) {
+            if (root.visit)
+                confidence = std::max(confidence, double(child->visit) / root.visit);
+        }
+    }
+};
@@ -0,0 +1,428 @@
+#pragma once
+#ifndef _EXPORT
+#define _EXPORT
+#endif
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "rule.hpp"
+
+// Boards advanced in lockstep by one PlayoutBatch: two vector registers of 64-bit words,
+// i.e. 4 boards with SSE2, 8 with AVX2 and 16 with AVX-512.
+#if defined(__AVX512F__)
+_EXPORT inline constexpr int PLAYOUT_LANES = 16;
+#elif defined(__AVX2__)
+_EXPORT inline constexpr int PLAYOUT_LANES = 8;
+#else
+_EXPORT inline constexpr int PLAYOUT_LANES = 4;
+#endif
+
+namespace simd {
+#if defined(__GNUC__) || defined(__clang__)
+template <int N>
+struct native_vector;
+#define SIMD_NATIVE_VECTOR(n)                                                               \
+    template <>                                                                             \
+    struct native_vector<n> {                                                               \
+        typedef std::uint64_t type __attribute__((vector_size(n * sizeof(std::uint64_t)))); \
+    };
+SIMD_NATIVE_VECTOR(2)
+SIMD_NATIVE_VECTOR(4)
+SIMD_NATIVE_VECTOR(8)
+SIMD_NATIVE_VECTOR(16)
+#undef SIMD_NATIVE_VECTOR
+#endif
+
+// N 64-bit lanes: a native vector with GCC/Clang, otherwise a plain array left to the auto-vectorizer.
+// Operations write through references, so that no function passes or returns a bare vector
+// type, whose calling convention depends on the enabled extensions (-Wpsabi).
+template <int N>
+struct u64xN {
+#if defined(__GNUC__) || defined(__clang__)
+    typename native_vector<N>::type v {};
+
+    static auto lift(auto f, const u64xN& a, const auto&... b) -> u64xN
+    {
+        u64xN r;
+        f(r.v, a.v, b.v...);
+        return r;
+    }
+#else
+    std::array<std::uint64_t, N> v {};
+
+    static auto lift(auto f, const u64xN& a, const auto&... b) -> u64xN
+    {
+        u64xN r;
+        for (int i = 0; i < N; i++)
+            f(r.v[i], a.v[i], b.v[i]...);
+        return r;
+    }
+#endif
+
+    auto& operator[](int i) { return v[i]; }
+    auto operator[](int i) const -> std::uint64_t { return v[i]; }
+
+    friend auto operator&(const u64xN& a, const u64xN& b) { return lift([](auto& r, const auto& x, const auto& y) { r = x & y; }, a, b); }
+    friend auto operator|(const u64xN& a, const u64xN& b) { return lift([](auto& r, const auto& x, const auto& y) { r = x | y; }, a, b); }
+    friend auto operator^(const u64xN& a, const u64xN& b) { return lift([](auto& r, const auto& x, const auto& y) { r = x ^ y; }, a, b); }
+    friend auto operator~(const u64xN& a) { return lift([](auto& r, const auto& x) { r = ~x; }, a); }
+    friend auto operator<<(const u64xN& a, int n) { return lift([n](auto& r, const auto& x) { r = x << n; }, a); }
+    friend auto operator>>(const u64xN& a, int n) { return lift([n](auto& r, const auto& x) { r = x >> n; }, a); }
+    friend auto operator+(const u64xN& a, std::uint64_t n) { return lift([n](auto& r, const auto& x) { r = x + n; }, a); }
+};
+
+template <class W>
+constexpr int lanes_of = sizeof(W) / sizeof(std::uint64_t);
+
+template <class W>
+constexpr auto splat(std::uint64_t x) -> W
+{
+    return W {} + x;
+}
+
+template <class W>
+constexpr auto any(const W& w) -> bool
+{
+    if constexpr (std::is_integral_v<W>) {
+        return w;
+    } else {
+        for (int i = 0; i < lanes_of<W>; i++)
+            if (w[i])
+                return true;
+        return false;
+    }
+}
+}
+
+// Row-major bit layout with one guard column per row, so that a shift by one never wraps
+// into the next row; a shift by STRIDE moves one row.
+template <int Rank>
+struct BitLayout {
+    static constexpr int STRIDE = Rank + 1;
+    static constexpr int WORDS = (Rank * STRIDE + 63) / 64;
+
+    static constexpr auto index(Position p) -> int { return p.x * STRIDE + p.y; }
+
+    static constexpr std::array<std::uint64_t, WORDS> ON_BOARD = [] {
+        std::array<std::uint64_t, WORDS> mask {};
+        for (int x = 0; x < Rank; x++)
+            for (int y = 0; y < Rank; y++)
+                mask[index({ x, y }) / 64] |= std::uint64_t { 1 } << (index({ x, y }) % 64);
+        return mask;
+    }();
+};
+
+// One bit plane per word type: std::uint64_t for a single board, simd::u64xN for a batch.
+template <int Rank, class W>
+struct Plane {
+    using Layout = BitLayout<Rank>;
+    std::array<W, Layout::WORDS> w {};
+
+    static auto on_board()
+    {
+        Plane p;
+        for (int i = 0; i < Layout::WORDS; i++)
+            p.w[i] = simd::splat<W>(Layout::ON_BOARD[i]);
+        return p;
+    }
+
+#define PLANE_BINARY_OP(op)                                   \
+    friend auto operator op(const Plane& a, const Plane& b) -> Plane \
+    {                                                                \
+        Plane r;                                                     \
+        for (int i = 0; i < Layout::WORDS; i++)                      \
+            r.w[i] = a.w[i] op b.w[i];                               \
+        return r;                                                    \
+    }
+    PLANE_BINARY_OP(&)
+    PLANE_BINARY_OP(|)
+    PLANE_BINARY_OP(^)
+#undef PLANE_BINARY_OP
+    friend auto operator~(const Plane& a) -> Plane
+    {
+        Plane r;
+        for (int i = 0; i < Layout::WORDS; i++)
+            r.w[i] = ~a.w[i];
+        return r;
+    }
+
+    auto shl(int n) const
+    {
+        Plane r;
+        for (int i = Layout::WORDS - 1; i > 0; i--)
+            r.w[i] = (w[i] << n) | (w[i - 1] >> (64 - n));
+        r.w[0] = w[0] << n;
+        return r;
+    }
+    auto shr(int n) const
+    {
+        Plane r;
+        for (int i = 0; i < Layout::WORDS - 1; i++)
+            r.w[i] = (w[i] >> n) | (w[i + 1] << (64 - n));
+        r.w[Layout::WORDS - 1] = w[Layout::WORDS - 1] >> n;
+        return r;
+    }
+    // the four neighbours of every set point
+    auto adjacent() const
+    {
+        return (shl(1) | shr(1) | shl(Layout::STRIDE) | shr(Layout::STRIDE)) & on_board();
+    }
+    // OR of all words, one value per lane
+    auto fold() const
+    {
+        W r {};
+        for (auto& x : w)
+            r = r | x;
+        return r;
+    }
+    auto any() const { return simd::any(fold()); }
+};
+
+// Stones of each group in `within` that still has a liberty in `empty`.
+// Both colours are flooded in the same loop so that the two dependency chains interleave.
+template <int Rank, class W>
+auto alive_stones(const Plane<Rank, W>& own, const Plane<Rank, W>& opp, const Plane<Rank, W>& empty)
+{
+    auto near_empty { empty.adjacent() };
+    auto a { near_empty & own }, b { near_empty & opp };
+    for (;;) {
+        auto na { (a | a.adjacent()) & own }, nb { (b | b.adjacent()) & opp };
+        if (!((na ^ a) | (nb ^ b)).any())
+            return std::pair { a, b };
+        a = na, b = nb;
+    }
+}
+
+// Lanes where placing `stone` for the owner of `own` is legal in NoGo: the new group keeps a
+// liberty and no adjacent opponent group loses its last one. All-ones for legal lanes.
+template <int Rank, class W>
+auto legal_lanes(const Plane<Rank, W>& own, const Plane<Rank, W>& opp, const Plane<Rank, W>& stone) -> W
+{
+    auto placed { own | stone };
+    auto empty { Plane<Rank, W>::on_board() & ~(placed | opp) };
+    auto [alive_own, alive_opp] = alive_stones(placed, opp, empty);
+    auto self_alive { (stone & alive_own).fold() };
+    auto captures { (stone.adjacent() & opp & ~alive_opp).fold() };
+    W mask {};
+    for (int i = 0; i < simd::lanes_of<W>; i++) {
+        if constexpr (std::is_integral_v<W>)
+            mask = self_alive && !captures ? ~W {} : W {};
+        else
+            mask[i] = self_alive[i] && !captures[i] ? ~std::uint64_t {} : 0;
+    }
+    return mask;
+}
+
+_EXPORT template <int Rank>
+struct BitBoard {
+    using Layout = BitLayout<Rank>;
+    Plane<Rank, std::uint64_t> black, white;
+
+    BitBoard() = default;
+    explicit BitBoard(const BoardBase& board)
+    {
+        for (int x = 0; x < Rank; x++) {
+            for (int y = 0; y < Rank; y++) {
+                auto i { Layout::index({ x, y }) };
+                auto role { board[{ x, y }] };
+                if (role == Role::BLACK)
+                    black.w[i / 64] |= std::uint64_t { 1 } << (i % 64);
+                else if (role == Role::WHITE)
+                    white.w[i / 64] |= std::uint64_t { 1 } << (i % 64);
+            }
+        }
+    }
+
+    auto stones(Role role) const -> const Plane<Rank, std::uint64_t>& { return role == Role::BLACK ? black : white; }
+
+    auto is_legal(Position p, Role role) const -> bool
+    {
+        Plane<Rank, std::uint64_t> stone;
+        auto i { Layout::index(p) };
+        stone.w[i / 64] = std::uint64_t { 1 } << (i % 64);
+        if ((stone & (black | white)).any())
+            return false;
+        return legal_lanes(stones(role), stones(-role), stone);
+    }
+
+    // every legal point for role, PLAYOUT_LANES candidate points per legal_lanes() call
+    auto legal_moves(Role role) const -> Plane<Rank, std::uint64_t>
+    {
+        using W = simd::u64xN<PLAYOUT_LANES>;
+        Plane<Rank, W> own, opp, stone;
+        for (int i = 0; i < Layout::WORDS; i++) {
+            own.w[i] = simd::splat<W>(stones(role).w[i]);
+            opp.w[i] = simd::splat<W>(stones(-role).w[i]);
+        }
+        auto empty { Plane<Rank, std::uint64_t>::on_board() & ~(black | white) };
+        Plane<Rank, std::uint64_t> legal;
+        std::array<int, PLAYOUT_LANES> points;
+        int lanes { 0 };
+        auto flush = [&] {
+            auto mask { legal_lanes(own, opp, stone) };
+            for (int lane = 0; lane < lanes; lane++) {
+                if (mask[lane])
+                    legal.w[points[lane] / 64] |= std::uint64_t { 1 } << (points[lane] % 64);
+                stone.w[points[lane] / 64][lane] = 0;
+            }
+            lanes = 0;
+        };
+        for (int i = 0; i < Layout::WORDS; i++) {
+            for (auto word { empty.w[i] }; word; word &= word - 1) {
+                points[lanes] = i * 64 + std::countr_zero(word);
+                stone.w[i][lanes] = word & -word;
+                if (++lanes == PLAYOUT_LANES)
+                    flush();
+            }
+        }
+        if (lanes)
+            flush();
+        return legal;
+    }
+};
+
+// The empty points that the side to move cannot play, in BoardBase::index() order.
+template <int Rank>
+auto illegal_points(const State& state) -> std::vector<Position>
+{
+    using Layout = BitLayout<Rank>;
+    BitBoard<Rank> board { *state.board };
+    auto legal { board.legal_moves(state.role) };
+    auto occupied { board.black | board.white };
+    std::vector<Position> points;
+    for (int x = 0; x < Rank; x++) {
+        for (int y = 0; y < Rank; y++) {
+            auto i { Layout::index({ x, y }) };
+            if (!((legal.w[i / 64] | occupied.w[i / 64]) >> (i % 64) & 1))
+                points.emplace_back(x, y);
+        }
+    }
+    return points;
+}
+
+_EXPORT inline auto illegal_points(const State& state) -> std::vector<Position>
+{
+    switch (state.board->get_rank()) {
+    case 9:
+        return illegal_points<9>(state);
+    case 11:
+        return illegal_points<11>(state);
+    case 13:
+        return illegal_points<13>(state);
+    default:
+        throw std::logic_error { "not supported size" };
+    }
+}
+
+// Random NoGo playouts for Lanes boards at once. Every lane tries a random candidate point
+// per step; a legal one is played, an illegal one is dropped from that lane's candidates,
+// and a side left without candidates loses.
+_EXPORT template <int Rank, int Lanes = PLAYOUT_LANES>
+class PlayoutBatch {
+    using W = simd::u64xN<Lanes>;
+    using Layout = BitLayout<Rank>;
+
+    static auto pick(const Plane<Rank, W>& candidates, int lane, auto& gen) -> int
+    {
+        int count { 0 };
+        for (int i = 0; i < Layout::WORDS; i++)
+            count += std::popcount(candidates.w[i][lane]);
+        if (!count)
+            return -1;
+        auto n { std::uniform_int_distribution<int> { 0, count - 1 }(gen) };
+        for (int i = 0; i < Layout::WORDS; i++) {
+            auto word { candidates.w[i][lane] };
+            auto bits { std::popcount(word) };
+            if (n >= bits) {
+                n -= bits;
+                continue;
+            }
+            for (; n; n--)
+                word &= word - 1;
+            return i * 64 + std::countr_zero(word);
+        }
+        return -1;
+    }
+
+public:
+    // winner of one playout per lane, each started from states[lane] with states[lane].role to move
+    static auto run(std::span<const State* const, Lanes> states, auto& gen) -> std::array<Role, Lanes>
+    {
+        Plane<Rank, W> own, opp;
+        std::array<Role, Lanes> to_move, winner {};
+        for (int lane = 0; lane < Lanes; lane++) {
+            BitBoard<Rank> board { *states[lane]->board };
+            to_move[lane] = states[lane]->role;
+            for (int i = 0; i < Layout::WORDS; i++) {
+                own.w[i][lane] = board.stones(to_move[lane]).w[i];
+                opp.w[i][lane] = board.stones(-to_move[lane]).w[i];
+            }
+        }
+        auto on_board { Plane<Rank, W>::on_board() };
+        auto candidates { on_board & ~(own | opp) };
+
+        for (int remaining { Lanes }; remaining;) {
+            Plane<Rank, W> stone;
+            for (int lane = 0; lane < Lanes; lane++) {
+                if (winner[lane])
+                    continue;
+                auto i { pick(candidates, lane, gen) };
+                if (i < 0) {
+                    winner[lane] = -to_move[lane];
+                    remaining--;
+                    continue;
+                }
+                stone.w[i / 64][lane] = std::uint64_t { 1 } << (i % 64);
+            }
+
+            auto legal { legal_lanes(own, opp, stone) };
+            for (int lane = 0; lane < Lanes; lane++)
+                if (legal[lane])
+                    to_move[lane] = -to_move[lane];
+
+            Plane<Rank, W> moved, kept;
+            moved.w.fill(legal);
+            kept.w.fill(~legal);
+            auto next_own { (opp & moved) | (own & kept) };
+            auto next_opp { ((own | stone) & moved) | (opp & kept) };
+            auto empty { on_board & ~(next_own | next_opp) };
+            candidates = (empty & moved) | (candidates & ~stone & kept);
+            own = next_own, opp = next_opp;
+        }
+        return winner;
+    }
+};
+
+// Winner of one random playout from each of states, started with state.role to move. Up to
+// Lanes states share one PlayoutBatch; lanes beyond states.size() replay states[0] and are
+// ignored.
+_EXPORT template <int Lanes = PLAYOUT_LANES>
+auto batched_playout(std::span<const State* const> states, auto& gen) -> std::vector<Role>
+{
+    if (states.empty() || std::ssize(states) > Lanes)
+        throw std::logic_error { "bad playout batch size" };
+    std::array<const State*, Lanes> lanes;
+    lanes.fill(states[0]);
+    std::ranges::copy(states, lanes.begin());
+    auto used = [&](auto winners) {
+        return std::vector<Role>(winners.begin(), winners.begin() + states.size());
+    };
+    switch (states[0]->board->get_rank()) {
+    case 9:
+        return used(PlayoutBatch<9, Lanes>::run(lanes, gen));
+    case 11:
+        return used(PlayoutBatch<11, Lanes>::run(lanes, gen));
+    case 13:
+        return used(PlayoutBatch<13, Lanes>::run(lanes, gen));
+    default:
+        throw std::logic_error { "not supported size" };
+    }
+}
@@ -3,46 +3,109 @@
 #define _EXPORT
 #endif
 
+#include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <stdexcept>
+#include <stop_token>
+#include <thread>
 #include <vector>
 
+#include "bitboard.hpp"
+#include "pattern.hpp"
 #include "rule.hpp"
+#include "valuenet.hpp"
 
 namespace chrono = std::chrono;
 using namespace std::chrono_literals;
 
-std::mt19937 rng(std::random_device {}());
+thread_local std::mt19937 rng(std::random_device {}());
 std::uniform_real_distribution<double> dist(0, 1);
 // static -> CE
 
+// how a newly expanded node is scored
+_EXPORT enum class LeafPolicy {
+    MOBILITY, // default_policy2
+    PLAYOUT, // random playouts, PLAYOUT_LANES leaves per PlayoutBatch, see bitboard.hpp
+    NETWORK, // value_network, options.batch leaves per evaluation
+};
+
+_EXPORT struct MCTSOptions {
+    double C { 0.1 };
+    LeafPolicy policy { LeafPolicy::MOBILITY };
+    // expand in pattern_table order and select with PUCT instead of UCB1
+    bool pattern_priors { false };
+    chrono::milliseconds time_limit { 1500ms };
+    int iterations { 0 }; // stop after this many root visits, 0 for time_limit only
+    int batch { 8 };
+};
+
 // struct to represent a node in the Monte Carlo Tree
 struct MCTSNode : std::enable_shared_from_this<MCTSNode> {
     using MCTSNode_ptr = std::shared_ptr<MCTSNode>;
 
     State state;
     std::vector<Position> available_actions;
+    std::vector<double> priors; // of available_actions, from pattern_table or value_network
     std::weak_ptr<MCTSNode> parent;
     std::vector<MCTSNode_ptr> children;
     int visit { 0 };
     double quality { 0 };
 
-    int reward { 0 };
+    const MCTSOptions& options;
+    double prior { 1 };
+    double reward { 0 };
 
-    MCTSNode(const State& state, std::weak_ptr<MCTSNode> parent = {})
+    MCTSNode(const State& state, const MCTSOptions& options, std::weak_ptr<MCTSNode> parent = {})
         : state(state)
         , parent(parent)
+        , options(options)
     {
         available_actions = state.available_actions();
-        reward = default_policy2();
+        if (options.pattern_priors)
+            priors = pattern_table.priors(state, available_actions);
+        switch (options.policy) {
+        case LeafPolicy::MOBILITY:
+            reward = default_policy2();
+            break;
+        case LeafPolicy::PLAYOUT:
+        case LeafPolicy::NETWORK:
+            // set by search_batch(), unless decided: the side to move has no moves and loses
+            if (available_actions.empty())
+                reward = 1;
+            break;
+        }
     }
+    // Unlinks the subtree level by level instead of through nested destructors, so deep
+    // trees cannot exhaust the stack. Subtrees still referenced elsewhere are left intact.
+    ~MCTSNode()
+    {
+        auto pending { std::move(children) };
+        while (!pending.empty()) {
+            auto node { std::move(pending.back()) };
+            pending.pop_back();
+            if (node.use_count() == 1) {
+                std::ranges::move(node->children, std::back_inserter(pending));
+                node->children.clear();
+            }
+        }
+    }
+
+    auto use_priors() const { return options.pattern_priors || options.policy == LeafPolicy::NETWORK; }
 
     auto add_child(const State& state)
     {
-        auto child = std::make_shared<MCTSNode>(state, weak_from_this());
+        auto child = std::make_shared<MCTSNode>(state, options, weak_from_this());
+        if (use_priors())
+            child->prior = children.size() < priors.size() ? priors[children.size()] : 1.0 / available_actions.size();
         children.push_back(child);
         return child;
     }
@@ -52,6 +115,11 @@ struct MCTSNode : std::enable_shared_from_this<MCTSNode> {
         auto ucb1 = [&](MCTSNode_ptr child) {
             return child->quality / child->visit + 2 * C * sqrt(log(2 * visit) / child->visit);
         };
+        auto puct = [&](MCTSNode_ptr child) {
+            return child->quality / child->visit + C * child->prior * sqrt(visit) / (1 + child->visit);
+        };
+        if (use_priors())
+            return *ranges::max_element(children, std::less {}, puct);
         return *ranges::max_element(children, std::less {}, ucb1);
     }
 
@@ -81,11 +149,84 @@ struct MCTSNode : std::enable_shared_from_this<MCTSNode> {
         return n4 - n3;
     }
 
+    void apply(const ValueNetwork::Output& output)
+    {
+        // a decided position keeps its exact reward
+        if (available_actions.empty())
+            return;
+        reward = -output.value;
+        if (!children.empty())
+            return;
+        // softmax over the legal points, expanded best first
+        auto rank { state.board->get_rank() };
+        std::vector<std::pair<double, Position>> scored;
+        for (auto pos : available_actions)
+            scored.emplace_back(output.policy[pos.x * rank + pos.y], pos);
+        std::ranges::stable_sort(scored, std::greater {}, [](auto& s) { return s.first; });
+        double max_logit { scored.empty() ? 0 : scored.front().first }, total { 0 };
+        for (auto& [logit, pos] : scored)
+            total += logit = std::exp(logit - max_logit);
+        priors.clear();
+        for (int i = 0; i < std::ssize(scored); i++) {
+            available_actions[i] = scored[i].second;
+            priors.push_back(scored[i].first / total);
+        }
+    }
+
+    // a pending loss on the path to the root (n = 1) or its removal (n = -1), so that the
+    // other leaves of a batch are selected elsewhere
+    void virtual_loss(int n)
+    {
+        auto weak_node { weak_from_this() };
+        while (auto node { weak_node.lock() }) {
+            node->visit += n;
+            node->quality -= n;
+            weak_node = node->parent;
+        }
+    }
+
+    // Selects distinct leaves and scores them together: PLAYOUT_LANES with one PlayoutBatch,
+    // or options.batch with one value_network call. Decided leaves are not scored but backed
+    // up at once with their exact reward.
+    void search_batch(double C)
+    {
+        std::vector<MCTSNode_ptr> leaves;
+        std::vector<const State*> states;
+        auto size { options.policy == LeafPolicy::PLAYOUT ? PLAYOUT_LANES : options.batch };
+        for (int i = 0; i < size; i++) {
+            auto leaf { tree_policy(C) };
+            if (leaf->available_actions.empty()) {
+                leaf->backup();
+                continue;
+            }
+            leaf->virtual_loss(1);
+            leaves.push_back(leaf);
+            states.push_back(&leaf->state);
+        }
+        if (leaves.empty())
+            return;
+        if (options.policy == LeafPolicy::PLAYOUT) {
+            auto winners { batched_playout(states, rng) };
+            for (int i = 0; i < std::ssize(leaves); i++) {
+                leaves[i]->virtual_loss(-1);
+                leaves[i]->reward = winners[i] == leaves[i]->state.role ? -1 : 1;
+                leaves[i]->backup();
+            }
+            return;
+        }
+        auto outputs { value_network->evaluate(states) };
+        for (int i = 0; i < std::ssize(leaves); i++) {
+            leaves[i]->virtual_loss(-1);
+            leaves[i]->apply(outputs[i]);
+            leaves[i]->backup();
+        }
+    }
+
     // backpropagate the result of the simulation
     void backup()
     {
         auto weak_node { weak_from_this() };
-        int temp_reward { reward };
+        double temp_reward { reward };
         while (auto node { weak_node.lock() }) {
             node->visit++;
             node->quality += temp_reward;
@@ -95,26 +236,90 @@ struct MCTSNode : std::enable_shared_from_this<MCTSNode> {
     }
 };
 
+// Destroys search trees on a background thread, so that freeing every node and board
+// clone does not delay the move that the search produced.
+_EXPORT class TreeReclaimer {
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    std::deque<std::shared_ptr<MCTSNode>> trees;
+    std::jthread worker;
+
+public:
+    TreeReclaimer()
+        : worker([this](std::stop_token stop) {
+            std::unique_lock lock { mutex };
+            while (cv.wait(lock, stop, [&] { return !trees.empty(); })) {
+                auto tree { std::move(trees.front()) };
+                trees.pop_front();
+                lock.unlock();
+                tree.reset();
+                lock.lock();
+            }
+        })
+    {
+    }
+    void reclaim(std::shared_ptr<MCTSNode> tree)
+    {
+        {
+            std::lock_guard guard { mutex };
+            trees.push_back(std::move(tree));
+        }
+        cv.notify_one();
+    }
+};
+
+_EXPORT inline TreeReclaimer tree_reclaimer;
+
 _EXPORT Position random_bot_player(const State& state)
 {
     auto actions = state.available_actions();
     return actions[rand() % actions.size()];
 }
 
-_EXPORT constexpr auto mcts_bot_player_generator(double C)
+// the searched tree; options must outlive it. Ends early once stop is requested, and calls
+// report every interval with the tree so far.
+_EXPORT auto mcts_search(const State& state, const MCTSOptions& options, std::stop_token stop = {},
+    std::function<void(const MCTSNode&)> report = {}, chrono::milliseconds interval = 500ms)
 {
-    return [=](const State& state) {
-        auto start = chrono::high_resolution_clock::now();
-        auto root = std::make_shared<MCTSNode>(state);
-        while (chrono::high_resolution_clock::now() - start < 1500ms) {
-            auto expand_node = root->tree_policy(C);
-            expand_node->backup();
+    auto start = chrono::high_resolution_clock::now();
+    auto last_report { start };
+    auto root = std::make_shared<MCTSNode>(state, options);
+    if (options.policy == LeafPolicy::NETWORK) {
+        if (!value_network)
+            throw std::logic_error { "value network not loaded" };
+        root->apply(value_network->evaluate(state));
+    }
+    for (auto now { start }; now - start < options.time_limit
+         && (!options.iterations || root->visit < options.iterations) && !stop.stop_requested();
+         now = chrono::high_resolution_clock::now()) {
+        if (report && now - last_report >= interval) {
+            report(*root);
+            last_report = now;
         }
-        if (!root->children.size()) {
-            return Position {};
+        if (options.policy != LeafPolicy::MOBILITY) {
+            root->search_batch(options.C);
+            continue;
         }
-        return root->best_child(0)->state.last_move;
+        auto expand_node = root->tree_policy(options.C);
+        expand_node->backup();
+    }
+    return root;
+}
+
+_EXPORT constexpr auto mcts_bot_player_generator(MCTSOptions options)
+{
+    return [=](const State& state, std::function<void(const MCTSNode&)> report = {}) {
+        auto root = mcts_search(state, options, {}, report, 1s);
+        if (report)
+            report(*root);
+        Position pos {};
+        if (root->children.size())
+            pos = root->best_child(0)->state.last_move;
+        tree_reclaimer.reclaim(std::move(root));
+        return pos;
     };
 }
 
-_EXPORT constexpr auto mcts_bot_player = mcts_bot_player_generator(0.1);
+_EXPORT constexpr auto mcts_bot_player = mcts_bot_player_generator({ .C = 0.1, .pattern_priors = true });
+_EXPORT constexpr auto mcts_playout_bot_player = mcts_bot_player_generator({ .C = 1.5, .policy = LeafPolicy::PLAYOUT, .pattern_priors = true });
+_EXPORT constexpr auto mcts_network_bot_player = mcts_bot_player_generator({ .C = 1.5, .policy = LeafPolicy::NETWORK });
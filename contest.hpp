@@ -3,14 +3,17 @@
 #include <algorithm>
 #include <cctype>
 #include <chrono>
+#include <cstdint>
 #include <ranges>
 #include <stdexcept>
+#include <string>
 #include <utility>
 #include <vector>
 
 #include <asio/ip/tcp.hpp>
 using asio::ip::tcp;
 
+#include "bitboard.hpp"
 #include "log.hpp"
 #include "message.hpp"
 #include "rule.hpp"
@@ -179,6 +182,16 @@ public:
     std::chrono::system_clock::time_point end_time;
     Role local_role { Role::NONE };
     bool is_replaying {};
+    std::uint64_t version {}; // bumped by every method that changes the contest
+
+    // What UiMessage::Game derives from the position, kept up to date by play() and rebuilt
+    // only after other changes of the position.
+    struct View {
+        std::uint64_t version { ~std::uint64_t {} };
+        std::vector<std::vector<int>> chessboard;
+        std::vector<Position> disabled_positions; // empty points the side to move cannot play
+        std::string moves; // encode() without the terminator
+    };
 
     Contest() = default;
     Contest(PlayerList players, int board_size = 9)
@@ -190,23 +203,20 @@ public:
     }
 
 private:
+    mutable View view;
+
     void _set_board_size(int size)
     {
-        switch (size) {
-        case 9:
-            current.board = std::make_shared<Board<9>>();
-            break;
-        case 11:
-            current.board = std::make_shared<Board<11>>();
-            break;
-        case 13:
-            current.board = std::make_shared<Board<13>>();
-            break;
-        default:
-            throw std::logic_error { "not supported size" };
-            break;
-        }
+        current.board = make_board(size);
         board_size = size;
+        version++;
+    }
+    // for changes that leave the position alone
+    void changed()
+    {
+        if (view.version == version)
+            view.version++;
+        version++;
     }
 
 public:
@@ -231,12 +241,14 @@ public:
     void confirm()
     {
         result.confirmed = true;
+        changed();
     }
     void reject()
     {
         if (status != Status::NOT_PREPARED)
             throw StatusError { "Contest already started" };
         players = {};
+        changed();
     }
 
     void enroll(Player&& player)
@@ -248,6 +260,7 @@ public:
             status = Status::ON_GOING;
             start_time = std::chrono::system_clock::now();
         }
+        changed();
     }
 
     void play(Player player, Position pos)
@@ -260,9 +273,10 @@ public:
             status = Status::GAME_OVER;
             result = { -player.role, WinType::SUICIDE };
             logger->warn("Play on occupied position {}, playerdata: {}", pos.to_string(), to_string(player));
+            changed();
             return;
         }
-        logger->info("contest play " + std::to_string(pos.x) + ", " + std::to_string(pos.y));
+        LOG_TRACE("contest play {}, {}", pos.x, pos.y);
         current = current.next_state(pos);
         moves.push_back(pos);
 
@@ -271,8 +285,19 @@ public:
             result = { winner, WinType::SUICIDE };
             end_time = std::chrono::system_clock::now();
         }
-        if (!current.available_actions().size())
+        // stones are never removed, so the empty points are the ones not played yet
+        auto disabled { illegal_points(current) };
+        if (disabled.size() == board_size * board_size - moves.size())
             should_giveup = true;
+        if (view.version == version) {
+            view.chessboard[pos.x][pos.y] = player.role.id;
+            view.disabled_positions = std::move(disabled);
+            if (!view.moves.empty())
+                view.moves += ' ';
+            view.moves += pos.to_string();
+            view.version++;
+        }
+        version++;
     }
 
     void concede(Player player)
@@ -284,6 +309,7 @@ public:
         status = Status::GAME_OVER;
         result = { -player.role, WinType::GIVEUP };
         end_time = std::chrono::system_clock::now();
+        changed();
     }
 
     void timeout(Player player)
@@ -295,18 +321,34 @@ public:
         status = Status::GAME_OVER;
         result = { -player.role, WinType::TIMEOUT };
         end_time = std::chrono::system_clock::now();
+        changed();
     }
 
     auto round() const -> int { return moves.size(); }
 
+    auto ui_view() const -> const View&
+    {
+        if (view.version != version) {
+            auto rank { current.board->get_rank() };
+            view.chessboard.assign(rank, std::vector<int>(rank));
+            for (int x = 0; x < rank; x++) {
+                for (int y = 0; y < rank; y++)
+                    view.chessboard[x][y] = (*current.board)[{ x, y }].id;
+            }
+            view.disabled_positions = illegal_points(current);
+            auto moves_str = moves | std::views::transform([](auto pos) { return pos.to_string(); });
+            view.moves = moves_str | ranges::views::join_with(' ') | ranges::to<std::string>();
+            view.version = version;
+        }
+        return view;
+    }
+
     auto encode() const -> string
     {
         std::string delimiter = " ";
         std::string terminator = result.win_type == WinType::GIVEUP ? "G"
             : result.win_type == WinType::TIMEOUT                   ? "T"
                                                                     : "";
-        auto moves_str = moves | std::views::transform([](auto pos) { return pos.to_string(); });
-        return (moves_str | ranges::views::join_with(delimiter) | ranges::to<std::string>())
-            + (terminator.empty() ? "" : (delimiter + terminator));
+        return ui_view().moves + (terminator.empty() ? "" : (delimiter + terminator));
     }
 };
\ No newline at end of file
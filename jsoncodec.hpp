@@ -0,0 +1,187 @@
+#pragma once
+#ifndef _EXPORT
+#define _EXPORT
+#endif
+
+#include <charconv>
+#include <concepts>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Direct JSON reading and writing for the fixed message schemas, producing exactly what
+// nlohmann::json::dump() does: objects with sorted keys, no whitespace, and strings escaped
+// as dump() escapes them. Anything outside the fast path (non-ASCII text, unexpected
+// layouts) is handed to nlohmann, so behaviour and errors stay the same.
+namespace json_codec {
+
+_EXPORT inline void write_string(std::string& out, std::string_view s)
+{
+    static constexpr char hex[] { "0123456789abcdef" };
+    for (auto c : s) {
+        if (static_cast<unsigned char>(c) >= 0x80) {
+            // dump() validates UTF-8 and throws on bad input
+            out += nlohmann::json(s).dump();
+            return;
+        }
+    }
+    out += '"';
+    for (auto c : s) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\b':
+            out += "\\b";
+            break;
+        case '\f':
+            out += "\\f";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xf];
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+_EXPORT inline void write_int(std::string& out, std::integral auto value)
+{
+    char digits[24];
+    out.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr);
+}
+
+_EXPORT inline void write_bool(std::string& out, bool value)
+{
+    out += value ? "true" : "false";
+}
+
+// Reads a flat object of string and integer members. Returns false, leaving the result
+// unspecified, as soon as the input is anything else.
+class FlatReader {
+    std::string_view in;
+    std::size_t i { 0 };
+
+    void skip_ws()
+    {
+        while (i < in.size() && (in[i] == ' ' || in[i] == '\t' || in[i] == '\n' || in[i] == '\r'))
+            i++;
+    }
+    auto consume(char c) -> bool
+    {
+        skip_ws();
+        if (i < in.size() && in[i] == c) {
+            i++;
+            return true;
+        }
+        return false;
+    }
+
+public:
+    explicit FlatReader(std::string_view in)
+        : in(in)
+    {
+    }
+
+    // an ASCII string without escapes other than the short ones
+    auto read_string(std::string& out) -> bool
+    {
+        if (!consume('"'))
+            return false;
+        out.clear();
+        for (; i < in.size(); i++) {
+            auto c { in[i] };
+            if (c == '"') {
+                i++;
+                return true;
+            }
+            if (static_cast<unsigned char>(c) < 0x20 || static_cast<unsigned char>(c) >= 0x80)
+                return false;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (++i == in.size())
+                return false;
+            switch (in[i]) {
+            case '"':
+            case '\\':
+            case '/':
+                out += in[i];
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+    // an integer as RFC 8259 writes it: no leading zeros, plus sign, fraction or exponent
+    auto read_int(std::int64_t& value) -> bool
+    {
+        skip_ws();
+        auto digits { i < in.size() && in[i] == '-' ? i + 1 : i };
+        if (digits + 1 < in.size() && in[digits] == '0' && in[digits + 1] >= '0' && in[digits + 1] <= '9')
+            return false;
+        auto [end, ec] { std::from_chars(in.data() + i, in.data() + in.size(), value) };
+        if (ec != std::errc {} || (end < in.data() + in.size() && (*end == '.' || *end == 'e' || *end == 'E')))
+            return false;
+        i = end - in.data();
+        return true;
+    }
+
+    // calls member(key) for every member, which reads the value and returns whether it could
+    auto read_object(auto&& member) -> bool
+    {
+        if (!consume('{'))
+            return false;
+        if (consume('}'))
+            return at_end();
+        std::string key;
+        do {
+            if (!read_string(key) || !consume(':') || !member(key))
+                return false;
+        } while (consume(','));
+        return consume('}') && at_end();
+    }
+    auto at_end() -> bool
+    {
+        skip_ws();
+        return i == in.size();
+    }
+};
+
+}
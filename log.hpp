@@ -1,7 +1,21 @@
 #pragma once
 
+// LOG_TRACE and LOG_DEBUG below this level compile to nothing; release builds keep info and up
+#ifndef SPDLOG_ACTIVE_LEVEL
+#ifdef NDEBUG
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_INFO
+#else
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+#endif
+
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
 
 #include <magic_enum.hpp>
 #include <magic_enum_format.hpp>
@@ -13,20 +27,52 @@
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
 
-std::optional<spdlog::logger> logger;
+#define LOG_TRACE(...) SPDLOG_LOGGER_TRACE(logger, __VA_ARGS__)
+#define LOG_DEBUG(...) SPDLOG_LOGGER_DEBUG(logger, __VA_ARGS__)
+
+// without sinks until init_log()
+std::shared_ptr<spdlog::logger> logger { std::make_shared<spdlog::logger>("logger") };
+
+// entries the background thread has not written yet; when full, the oldest are dropped
+// rather than blocking the thread that logs
+static constexpr std::size_t LOG_QUEUE_SIZE { 1 << 16 };
+
+// spdlog::level::from_str() without its fallback to off: nullopt for an unknown name
+inline auto parse_log_level(std::string_view name) -> std::optional<spdlog::level::level_enum>
+{
+    auto level { spdlog::level::from_str(std::string { name }) };
+    if (level == spdlog::level::off && name != "off")
+        return std::nullopt;
+    return level;
+}
+
+// Formats on the calling thread and writes on a background one: the sinks are only touched
+// by the thread pool's single worker, and flushed every second or on a warning. The level is
+// NOGO_LOG_LEVEL (trace, debug, info, warn, error, critical or off), the compiled-in one by
+// default; see Participant::log_level() to change it at run time.
 void init_log()
 {
-    auto console_sink = std::make_shared<spdlog::sinks::ansicolor_stdout_sink_mt>();
+    auto console_sink = std::make_shared<spdlog::sinks::ansicolor_stdout_sink_st>();
     console_sink->set_level(spdlog::level::info);
-    auto trace_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("./logs/trace_log", true);
+    auto trace_sink = std::make_shared<spdlog::sinks::basic_file_sink_st>("./logs/trace_log", true);
     trace_sink->set_level(spdlog::level::trace);
-    auto debug_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("./logs/debug_log", true);
+    auto debug_sink = std::make_shared<spdlog::sinks::basic_file_sink_st>("./logs/debug_log", true);
     debug_sink->set_level(spdlog::level::debug);
-    auto info_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("./logs/info_log", true);
+    auto info_sink = std::make_shared<spdlog::sinks::basic_file_sink_st>("./logs/info_log", true);
     info_sink->set_level(spdlog::level::info);
-    auto warn_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("./logs/warn_log", true);
+    auto warn_sink = std::make_shared<spdlog::sinks::basic_file_sink_st>("./logs/warn_log", true);
     warn_sink->set_level(spdlog::level::warn);
-    logger = spdlog::logger("logger", { console_sink, trace_sink, debug_sink, info_sink, warn_sink });
-    logger->set_level(spdlog::level::trace);
-    logger->flush_on(spdlog::level::debug);
-}
\ No newline at end of file
+    spdlog::init_thread_pool(LOG_QUEUE_SIZE, 1);
+    logger = std::make_shared<spdlog::async_logger>("logger", spdlog::sinks_init_list { console_sink, trace_sink, debug_sink, info_sink, warn_sink },
+        spdlog::thread_pool(), spdlog::async_overflow_policy::overrun_oldest);
+    logger->set_level(spdlog::level::level_enum(SPDLOG_ACTIVE_LEVEL));
+    if (auto value = std::getenv("NOGO_LOG_LEVEL")) {
+        if (auto level = parse_log_level(value))
+            logger->set_level(*level);
+        else
+            logger->error("Unknown NOGO_LOG_LEVEL: {}", value);
+    }
+    logger->flush_on(spdlog::level::warn);
+    spdlog::register_logger(logger);
+    spdlog::flush_every(std::chrono::seconds { 1 });
+}
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <cstdint>
 #include <nlohmann/json.hpp>
 #include <string_view>
+#include <utility>
 
+#include "jsoncodec.hpp"
 #include "utility.hpp"
 
 using nlohmann::json;
@@ -46,6 +49,22 @@ _EXPORT enum class OpCode : int {
     REPLAY_STOP_MOVE_OP, // 对局回放退出介入
     // -------- Bot --------
     BOT_HOSTING_OP, // 切换 AI 托管状态
+    ANALYSIS_OP, // 分析当前局面（data1 = 候选数，0 为停止, data2 = 限时毫秒）
+    ANALYSIS_RESULT_OP, // 分析结果（data1 = running/done, data2 = 候选着法 JSON）
+    // -------- Room --------
+    CREATE_ROOM_OP, // 创建并进入房间（data1 = 房间名，空为自动命名）
+    JOIN_ROOM_OP, // 进入房间（data1 = 房间名，空为大厅）
+    ROOM_RESULT_OP, // 房间操作结果（data1 = success/failed, data2 = 房间名/原因）
+    // -------- Protocol --------
+    PROTOCOL_OP, // 协商传输协议（data1 = 协议, data2 = offer/accept）
+    // -------- UI State --------
+    UI_STATE_DELTA_OP, // UI 状态增量（data1 = 版本, data2 = 增量或完整状态 JSON）
+    UI_STATE_SYNC_OP, // 请求 UI 状态，此后改发增量（data1 = 客户端版本，与当前版本一致时只发增量）
+    // -------- Spectator --------
+    SPECTATE_OP, // 以观众身份进入房间，只读（data1 = 房间名）
+    // -------- Admin --------
+    METRICS_OP, // 运行时指标，仅限本地（data1 = reset 则读取后清零；回复 data2 = 指标 JSON）
+    LOG_LEVEL_OP, // 日志级别，仅限本地（data1 = trace/debug/info/warn/error/critical/off，空则只查询；回复 data1 = 当前级别）
     // -------- Extend OpCode End --------
 };
 
@@ -55,6 +74,24 @@ _EXPORT enum class PlayerType {
     BOT_PLAYER,
 };
 
+// Traffic that can be delayed, collapsed or dropped for a slow reader; everything else
+// controls the game or the connection.
+_EXPORT constexpr auto is_bulk(OpCode op) -> bool
+{
+    switch (op) {
+    case OpCode::CHAT_OP:
+    case OpCode::CHAT_SEND_MESSAGE_OP:
+    case OpCode::CHAT_SEND_BROADCAST_MESSAGE_OP:
+    case OpCode::CHAT_RECEIVE_MESSAGE_OP:
+    case OpCode::UPDATE_UI_STATE_OP:
+    case OpCode::ANALYSIS_RESULT_OP:
+    case OpCode::UI_STATE_DELTA_OP:
+        return true;
+    default:
+        return false;
+    }
+}
+
 _EXPORT struct Message {
     OpCode op;
     string data1, data2;
@@ -68,11 +105,49 @@ _EXPORT struct Message {
     }
     Message(string_view sv)
     {
-        from_json(json::parse(sv), *this);
+        if (!parse(sv))
+            from_json(json::parse(sv), *this);
     }
     auto to_string() const -> string
     {
-        return json(*this).dump();
+        string out;
+        append_to(out);
+        return out;
+    }
+    // same bytes as json(*this).dump()
+    void append_to(string& out) const
+    {
+        out += R"({"data1":)";
+        json_codec::write_string(out, data1);
+        out += R"(,"data2":)";
+        json_codec::write_string(out, data2);
+        out += R"(,"op":)";
+        json_codec::write_int(out, std::to_underlying(op));
+        out += '}';
+    }
+    // the common case of plain ASCII members; false leaves the rest to nlohmann
+    auto parse(string_view sv) -> bool
+    {
+        json_codec::FlatReader reader { sv };
+        auto seen { 0 };
+        return reader.read_object([&](const string& key) {
+            if (key == "data1") {
+                seen |= 1;
+                return reader.read_string(data1);
+            }
+            if (key == "data2") {
+                seen |= 2;
+                return reader.read_string(data2);
+            }
+            if (key != "op")
+                return false;
+            seen |= 4;
+            std::int64_t value;
+            if (!reader.read_int(value) || value != int(value))
+                return false;
+            op = OpCode(value);
+            return true;
+        }) && seen == 7;
     }
 
     NLOHMANN_DEFINE_TYPE_INTRUSIVE(Message, op, data1, data2)
@@ -0,0 +1,314 @@
+#pragma once
+#ifndef _EXPORT
+#define _EXPORT
+#endif
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <fmt/format.h>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <utility>
+
+#include "message.hpp"
+
+// Latency histograms in the manner of HdrHistogram with 3 significant bits: values below 8
+// have a bucket each and every power of two above is split into 8, so a bucket is at most
+// 12.5% wide. Recording is a few relaxed atomic adds.
+_EXPORT class LatencyHistogram {
+    static constexpr int SUB_BITS { 3 }, SUB { 1 << SUB_BITS }, BUCKETS { (64 - SUB_BITS + 1) * SUB };
+
+    std::array<std::atomic<std::uint64_t>, BUCKETS> counts {};
+    std::atomic<std::uint64_t> total_count {}, total_value {}, max_value {};
+    // since the start, which reset() keeps: exported counters must not go back
+    std::atomic<std::uint64_t> recorded_count {}, recorded_value {};
+
+    static constexpr auto index(std::uint64_t value) -> int
+    {
+        if (value < SUB)
+            return value;
+        auto exponent { std::bit_width(value) - 1 - SUB_BITS };
+        return (exponent + 1) * SUB + (value >> exponent & (SUB - 1));
+    }
+    // the highest value in bucket i
+    static constexpr auto highest(int i) -> std::uint64_t
+    {
+        if (i < SUB)
+            return i;
+        auto exponent { i / SUB - 1 };
+        return ((std::uint64_t { SUB } + i % SUB + 1) << exponent) - 1;
+    }
+
+public:
+    void record(std::uint64_t value)
+    {
+        counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+        total_count.fetch_add(1, std::memory_order_relaxed);
+        total_value.fetch_add(value, std::memory_order_relaxed);
+        recorded_count.fetch_add(1, std::memory_order_relaxed);
+        recorded_value.fetch_add(value, std::memory_order_relaxed);
+        for (auto seen { max_value.load(std::memory_order_relaxed) }; value > seen && !max_value.compare_exchange_weak(seen, value, std::memory_order_relaxed);)
+            ;
+    }
+    auto count() const -> std::uint64_t
+    {
+        return total_count.load(std::memory_order_relaxed);
+    }
+    auto sum() const -> std::uint64_t
+    {
+        return total_value.load(std::memory_order_relaxed);
+    }
+    auto cumulative_count() const -> std::uint64_t
+    {
+        return recorded_count.load(std::memory_order_relaxed);
+    }
+    auto cumulative_sum() const -> std::uint64_t
+    {
+        return recorded_value.load(std::memory_order_relaxed);
+    }
+    auto mean() const -> double
+    {
+        auto n { count() };
+        return n ? double(sum()) / n : 0;
+    }
+    auto maximum() const -> std::uint64_t
+    {
+        return max_value.load(std::memory_order_relaxed);
+    }
+    // q in [0, 1]; approximate while recording goes on
+    auto percentile(double q) const -> std::uint64_t
+    {
+        auto n { count() };
+        if (!n)
+            return 0;
+        auto rank { std::max<std::uint64_t>(1, std::uint64_t(q * n + 0.5)) };
+        std::uint64_t seen { 0 };
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::min(highest(i), maximum());
+        }
+        return maximum();
+    }
+    // each bucket with a count: its highest value and the count, for exporters
+    void for_each_bucket(auto&& f) const
+    {
+        for (int i = 0; i < BUCKETS; i++) {
+            if (auto n { counts[i].load(std::memory_order_relaxed) })
+                f(highest(i), n);
+        }
+    }
+    // all but the cumulative count and sum
+    void reset()
+    {
+        for (auto& n : counts)
+            n.store(0, std::memory_order_relaxed);
+        total_count = total_value = max_value = 0;
+    }
+};
+
+// A counter (or, with negative additions, a gauge) that threads update without contending:
+// each thread adds to a cache line of its own, threads beyond SHARDS sharing, and reading
+// sums the shards.
+_EXPORT class ShardedCounter {
+    static constexpr int SHARDS { 64 };
+    struct alignas(64) Shard {
+        std::atomic<std::int64_t> value {};
+    };
+    std::array<Shard, SHARDS> shards {};
+
+    static auto shard() -> int
+    {
+        static std::atomic<int> threads;
+        thread_local int i { threads++ % SHARDS };
+        return i;
+    }
+
+public:
+    void add(std::int64_t n = 1)
+    {
+        shards[shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    auto value() const -> std::int64_t
+    {
+        std::int64_t sum { 0 };
+        for (auto& shard : shards)
+            sum += shard.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+};
+
+// Where Room::process_data and the write path spend their time, per OpCode: PARSE a frame
+// into a Message, WAIT for the room's strand, HANDLE it, serialise a UI_STATE and ENQUEUE
+// a message for a participant. Message and byte counters are kept per direction, next to
+// the counters and gauges of to_prometheus().
+_EXPORT class ServerMetrics {
+public:
+    enum class Stage {
+        PARSE,
+        WAIT,
+        HANDLE,
+        UI_STATE,
+        ENQUEUE,
+    };
+    static constexpr std::array<const char*, 5> STAGE_NAMES { "parse", "wait", "handle", "ui_state", "enqueue" };
+    using clock = std::chrono::steady_clock;
+
+    struct Direction {
+        ShardedCounter messages, bytes;
+
+        void record(std::size_t size, std::size_t count = 1)
+        {
+            messages.add(count);
+            bytes.add(size);
+        }
+    };
+    Direction in, out;
+    ShardedCounter moves, games, search_iterations; // totals
+    ShardedCounter participants, rooms, queued_bytes, bot_jobs; // current values
+    std::atomic<std::int64_t> loop_lag {}; // nanoseconds, of the last probe
+
+private:
+    static constexpr int OPS { 128 };
+    // allocated on first use, so that only the OpCodes seen take memory
+    std::array<std::array<std::atomic<LatencyHistogram*>, OPS>, STAGE_NAMES.size()> histograms {};
+
+    // as in wire.hpp: the standard OpCodes first, the extended ones from 64
+    static constexpr auto slot(OpCode op) -> int
+    {
+        auto value { std::to_underlying(op) };
+        auto i { value >= 200000 ? value - 200000 : value - 100000 + 64 };
+        return i >= 0 && i < OPS ? i : -1;
+    }
+    static constexpr auto op_code(int slot) -> OpCode
+    {
+        return OpCode(slot < 64 ? slot + 200000 : slot - 64 + 100000);
+    }
+
+public:
+    ServerMetrics() = default;
+    ServerMetrics(const ServerMetrics&) = delete;
+    ~ServerMetrics()
+    {
+        for (auto& stage : histograms) {
+            for (auto& histogram : stage)
+                delete histogram.load();
+        }
+    }
+
+    auto histogram(Stage stage, OpCode op) -> LatencyHistogram*
+    {
+        auto i { slot(op) };
+        if (i < 0)
+            return nullptr;
+        auto& entry { histograms[std::to_underlying(stage)][i] };
+        auto histogram { entry.load(std::memory_order_acquire) };
+        if (!histogram) {
+            auto created { std::make_unique<LatencyHistogram>() };
+            if (entry.compare_exchange_strong(histogram, created.get(), std::memory_order_acq_rel))
+                histogram = created.release();
+        }
+        return histogram;
+    }
+    void record(Stage stage, OpCode op, clock::duration elapsed)
+    {
+        if (auto histogram { this->histogram(stage, op) })
+            histogram->record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    // f(stage, op, histogram) for every histogram recorded into
+    void for_each(auto&& f) const
+    {
+        for (std::size_t stage = 0; stage < histograms.size(); stage++) {
+            for (int i = 0; i < OPS; i++) {
+                if (auto histogram { histograms[stage][i].load(std::memory_order_acquire) })
+                    f(Stage(stage), op_code(i), *histogram);
+            }
+        }
+    }
+
+    // {"in": {"messages", "bytes"}, "out": ..., "latency": {op: {stage: {"count", "mean",
+    // "p50", "p99", "p999", "max"}}}}, latencies in microseconds
+    auto to_json() const -> nlohmann::json
+    {
+        auto direction = [](const Direction& d) {
+            return nlohmann::json { { "messages", d.messages.value() }, { "bytes", d.bytes.value() } };
+        };
+        nlohmann::json latency = nlohmann::json::object();
+        for_each([&](Stage stage, OpCode op, const LatencyHistogram& histogram) {
+            latency[std::to_string(std::to_underlying(op))][STAGE_NAMES[std::to_underlying(stage)]] = {
+                { "count", histogram.count() },
+                { "mean", histogram.mean() / 1000 },
+                { "p50", histogram.percentile(0.5) / 1000.0 },
+                { "p99", histogram.percentile(0.99) / 1000.0 },
+                { "p999", histogram.percentile(0.999) / 1000.0 },
+                { "max", histogram.maximum() / 1000.0 },
+            };
+        });
+        return { { "in", direction(in) }, { "out", direction(out) }, { "latency", latency } };
+    }
+    // in the Prometheus text format; the latencies as summaries in seconds, the quantiles of
+    // them since the last reset() and their sums and counts since the start
+    auto to_prometheus() const -> std::string
+    {
+        std::string text;
+        auto metric = [&](const char* name, const char* type, const char* help, auto value) {
+            fmt::format_to(std::back_inserter(text), "# HELP {0} {2}\n# TYPE {0} {1}\n{0} {3}\n", name, type, help, value);
+        };
+        metric("nogo_participants", "gauge", "Connected participants.", participants.value());
+        metric("nogo_rooms", "gauge", "Rooms, including the lobby.", rooms.value());
+        metric("nogo_queued_write_bytes", "gauge", "Bytes waiting in write queues.", queued_bytes.value());
+        metric("nogo_bot_jobs", "gauge", "Bot moves and analyses being searched.", bot_jobs.value());
+        metric("nogo_search_iterations_total", "counter", "MCTS iterations of bot moves and analyses.", search_iterations.value());
+        metric("nogo_moves_total", "counter", "Moves played.", moves.value());
+        metric("nogo_games_total", "counter", "Games finished.", games.value());
+        metric("nogo_event_loop_lag_seconds", "gauge", "How late the last event loop probe ran.", loop_lag.load(std::memory_order_relaxed) / 1e9);
+        text += "# HELP nogo_messages_total Messages received and sent.\n# TYPE nogo_messages_total counter\n";
+        fmt::format_to(std::back_inserter(text), "nogo_messages_total{{direction=\"in\"}} {}\nnogo_messages_total{{direction=\"out\"}} {}\n", in.messages.value(), out.messages.value());
+        text += "# HELP nogo_bytes_total Bytes received and sent.\n# TYPE nogo_bytes_total counter\n";
+        fmt::format_to(std::back_inserter(text), "nogo_bytes_total{{direction=\"in\"}} {}\nnogo_bytes_total{{direction=\"out\"}} {}\n", in.bytes.value(), out.bytes.value());
+        text += "# HELP nogo_latency_seconds Time spent per OpCode and stage.\n# TYPE nogo_latency_seconds summary\n";
+        for_each([&](Stage stage, OpCode op, const LatencyHistogram& histogram) {
+            auto labels { fmt::format("op=\"{}\",stage=\"{}\"", std::to_underlying(op), STAGE_NAMES[std::to_underlying(stage)]) };
+            for (auto q : { 0.5, 0.99, 0.999 })
+                fmt::format_to(std::back_inserter(text), "nogo_latency_seconds{{{},quantile=\"{}\"}} {}\n", labels, q, histogram.percentile(q) / 1e9);
+            fmt::format_to(std::back_inserter(text), "nogo_latency_seconds_sum{{{}}} {}\nnogo_latency_seconds_count{{{}}} {}\n", labels, histogram.cumulative_sum() / 1e9, labels, histogram.cumulative_count());
+        });
+        return text;
+    }
+    // what to_json() reports of the histograms; the counters only grow
+    void reset()
+    {
+        for (auto& stage : histograms) {
+            for (auto& histogram : stage) {
+                if (auto p { histogram.load(std::memory_order_acquire) })
+                    p->reset();
+            }
+        }
+    }
+};
+
+_EXPORT inline ServerMetrics metrics;
+
+// records the time until it goes out of scope
+_EXPORT class StageTimer {
+    ServerMetrics::Stage stage;
+    OpCode op;
+    ServerMetrics::clock::time_point start { ServerMetrics::clock::now() };
+
+public:
+    StageTimer(ServerMetrics::Stage stage, OpCode op)
+        : stage(stage)
+        , op(op)
+    {
+    }
+    StageTimer(const StageTimer&) = delete;
+    ~StageTimer()
+    {
+        metrics.record(stage, op, ServerMetrics::clock::now() - start);
+    }
+};
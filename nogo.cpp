@@ -1,13 +1,17 @@
 #ifndef _EXPORT
 #define _EXPORT
 #endif
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <ranges>
+#include <thread>
 #include <vector>
 
 #include "contest.hpp"
 #include "log.hpp"
 #include "network.hpp"
+#include "selfplay.hpp"
 #include "utility.hpp"
 
 auto main(int argc, char* argv[]) -> int
@@ -15,13 +19,70 @@ auto main(int argc, char* argv[]) -> int
     init_log();
     for (int i = 0; i < argc; i++)
         logger->info("argv[{}]: {}", i, argv[i]);
+    if (auto path = std::getenv("NOGO_VALUE_NETWORK")) {
+        try {
+            value_network = ValueNetwork::load(path);
+            logger->info("value network loaded: {}, rank = {}", path, value_network->rank);
+        } catch (std::exception& e) {
+            logger->error("Failed to load value network: {}", e.what());
+        }
+    }
     if (argc < 2) {
-        std::cerr << "Usage: server <port> [<port> ...]\n";
+        std::cerr << "Usage: server <port> [<port> ...]\n"
+                     "       server selfplay <file> <games> [<size>] [zlib]\n";
         logger->error("Usage: server <port> [<port> ...]\n");
         return 1;
     }
+    if (argv[1] == "selfplay"sv) {
+        if (argc < 4) {
+            std::cerr << "Usage: server selfplay <file> <games> [<size>] [zlib]\n";
+            return 1;
+        }
+        try {
+            run_selfplay(argv[2], stoi(argv[3]), argc > 4 ? stoi(argv[4]) : 9, argc > 5 && argv[5] == "zlib"sv);
+        } catch (std::exception& e) {
+            std::cerr << "selfplay: " << e.what() << "\n"
+                      << "Usage: server selfplay <file> <games> [<size>] [zlib]\n";
+            return 1;
+        }
+        return 0;
+    }
     auto ports = std::ranges::subrange(argv + 1, argv + argc)
         | std::views::transform([](auto s){ return integer_cast<unsigned short>(s); })
         | ranges::to<std::vector>();
-    launch_server(ports);
+    // NOGO_THREADS event loop threads, one per core by default
+    auto threads { std::max(1, int(std::thread::hardware_concurrency())) };
+    if (auto value = std::getenv("NOGO_THREADS"))
+        threads = std::max(1, std::atoi(value));
+    if (auto value = std::getenv("NOGO_MAX_FRAME_SIZE"))
+        MAX_FRAME_SIZE = std::max(1, std::atoi(value));
+    // write queue limits per connection, see SlowConsumerPolicy
+    if (auto value = std::getenv("NOGO_MAX_QUEUED_MESSAGES"))
+        MAX_QUEUED_MESSAGES = std::max(1, std::atoi(value));
+    if (auto value = std::getenv("NOGO_MAX_QUEUED_BYTES"))
+        MAX_QUEUED_BYTES = std::max(1, std::atoi(value));
+    if (auto value = std::getenv("NOGO_BULK_BYTES_PER_SECOND"))
+        BULK_BYTES_PER_SECOND = std::max(0, std::atoi(value));
+    if (auto value = std::getenv("NOGO_SLOW_CONSUMER_POLICY")) {
+        if (auto policy = magic_enum::enum_cast<SlowConsumerPolicy>(value))
+            SLOW_CONSUMER_POLICY = *policy;
+        else
+            logger->error("Unknown NOGO_SLOW_CONSUMER_POLICY: {}", value);
+    }
+    // in seconds, 0 to disable
+    if (auto value = std::getenv("NOGO_IDLE_TIMEOUT"))
+        IDLE_TIMEOUT = seconds { std::max(0, std::atoi(value)) };
+    if (auto value = std::getenv("NOGO_REQUEST_TIMEOUT"))
+        REQUEST_TIMEOUT = seconds { std::max(0, std::atoi(value)) };
+    if (auto value = std::getenv("NOGO_BOT_POLICY")) {
+        if (auto policy = magic_enum::enum_cast<LeafPolicy>(value); policy && policy != LeafPolicy::NETWORK)
+            BOT_POLICY = *policy;
+        else
+            logger->error("Unknown NOGO_BOT_POLICY: {}", value);
+    }
+    if (auto value = std::getenv("NOGO_METRICS_PORT"))
+        METRICS_PORT = integer_cast<asio::ip::port_type>(value);
+    launch_server(ports, threads);
+    // writes what is still queued
+    spdlog::shutdown();
 }
\ No newline at end of file
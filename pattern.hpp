@@ -0,0 +1,101 @@
+#pragma once
+#ifndef _EXPORT
+#define _EXPORT
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "rule.hpp"
+
+// Move priors from local shape: a 3x3 table indexed by BoardBase::pattern() seen from the
+// player to move (0 empty, 1 own, 2 opponent, 3 off board per cell), scaled by a table of
+// short-of-liberty neighbour groups (2 bits per orthogonal cell: 0 none, 1 own, 2 opponent).
+_EXPORT class PatternTable {
+    std::array<float, 1 << 16> shape;
+    std::array<float, 1 << 8> liberty;
+
+    static constexpr auto cell(int code, int k) { return (code >> (2 * k)) & 3; }
+
+    // swap the two colours in every cell of a 3x3 code
+    static constexpr auto swap_colors(std::uint32_t code) -> std::uint32_t
+    {
+        auto differ { (code ^ (code >> 1)) & 0x5555 };
+        return code ^ (differ | (differ << 1));
+    }
+
+public:
+    enum Cell { EMPTY,
+        OWN,
+        OPPONENT,
+        EDGE };
+
+    // Hand-tuned weights, filled in place: the shape table is too large to build on the stack
+    // and copy. Filling our own eye throws away a move the opponent could never take from us; a
+    // move that leaves an empty neighbour walled in by our stones makes that point an eye.
+    PatternTable()
+    {
+        for (int code = 0; code < (1 << 16); code++) {
+            auto sheltered { 0 }, opponents { 0 }, eyes { 0 }, diagonal_own { 0 };
+            for (auto k : BoardBase::orthogonal_ring) {
+                auto c { cell(code, k) };
+                sheltered += c == OWN || c == EDGE;
+                opponents += c == OPPONENT;
+                // the orthogonal empty neighbour's other two neighbours inside the window
+                auto corner_a { k == 1 || k == 6 ? k - 1 : k == 3 ? 0 : 2 };
+                auto corner_b { k == 1 || k == 6 ? k + 1 : k == 3 ? 5 : 7 };
+                auto walled = [&](int j) { return cell(code, j) == OWN || cell(code, j) == EDGE; };
+                eyes += c == EMPTY && walled(corner_a) && walled(corner_b);
+            }
+            for (auto k : { 0, 2, 5, 7 })
+                diagonal_own += cell(code, k) == OWN;
+            auto weight { std::exp(0.4 * eyes + 0.1 * diagonal_own - 0.3 * std::max(0, opponents - 1)) };
+            shape[code] = sheltered == 4 ? 0.05 * weight : weight;
+        }
+        for (int code = 0; code < (1 << 8); code++) {
+            double weight { 1 };
+            for (int k = 0; k < 4; k++)
+                weight *= cell(code, k) == OWN ? 0.7 : cell(code, k) == OPPONENT ? 1.3 : 1;
+            liberty[code] = weight;
+        }
+    }
+
+    auto score(const BoardBase& board, Position p, Role role) const -> double
+    {
+        auto code { board.pattern(p) };
+        auto neighborhood { code & 0xffff };
+        if (role == Role::WHITE)
+            neighborhood = swap_colors(neighborhood);
+        auto short_of_liberty { 0 };
+        for (int k = 0; k < 4; k++) {
+            if (code & (1 << (16 + k)))
+                short_of_liberty |= cell(neighborhood, BoardBase::orthogonal_ring[k]) << (2 * k);
+        }
+        return shape[neighborhood] * liberty[short_of_liberty];
+    }
+
+    // Sorts actions by descending score and returns their priors, normalised to sum to 1.
+    auto priors(const State& state, std::vector<Position>& actions) const -> std::vector<double>
+    {
+        std::vector<std::pair<double, Position>> scored;
+        scored.reserve(actions.size());
+        for (auto pos : actions)
+            scored.emplace_back(score(*state.board, pos, state.role), pos);
+        std::ranges::stable_sort(scored, std::greater {}, [](auto& s) { return s.first; });
+
+        auto total { std::accumulate(scored.begin(), scored.end(), 0.0, [](double sum, auto& s) { return sum + s.first; }) };
+        std::vector<double> result;
+        result.reserve(scored.size());
+        for (int i = 0; i < std::ssize(scored); i++) {
+            actions[i] = scored[i].second;
+            result.push_back(scored[i].first / total);
+        }
+        return result;
+    }
+};
+
+_EXPORT inline PatternTable pattern_table;
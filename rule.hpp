@@ -2,11 +2,14 @@
 
 #include <algorithm>
 #include <array>
+#include <cstdint>
+#include <fmt/format.h>
 #include <iostream>
 #include <memory>
 #include <nlohmann/json.hpp>
 #include <ranges>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 
 #include "utility.hpp"
@@ -93,6 +96,12 @@ class BoardBase {
     static constexpr std::array delta { Position { -1, 0 }, Position { 1, 0 }, Position { 0, -1 }, Position { 0, 1 } };
 
 protected:
+    // 3x3 neighbourhood in row-major order, the centre skipped; ring[7 - k] is the opposite of ring[k]
+    static constexpr std::array ring {
+        Position { -1, -1 }, Position { -1, 0 }, Position { -1, 1 }, Position { 0, -1 },
+        Position { 0, 1 }, Position { 1, -1 }, Position { 1, 0 }, Position { 1, 1 }
+    };
+
     auto neighbor(Position p) const
     {
         return delta | std::views::transform([&](auto d) { return p + d; })
@@ -127,6 +136,11 @@ public:
     virtual bool has_liberties(Position p) const = 0;
     virtual bool is_capturing(Position p) const = 0;
     virtual auto get_rank() const -> int = 0;
+    // ring indices of the orthogonal neighbours
+    static constexpr std::array orthogonal_ring { 1, 3, 4, 6 };
+    // bits 0-15: 2 bits per ring cell (0 empty, 1 black, 2 white, 3 off board)
+    // bits 16-19: orthogonal ring cell k holds a group with at most 2 pseudo liberties
+    virtual auto pattern(Position p) const -> std::uint32_t = 0;
     virtual auto to_string() const -> std::string = 0;
     virtual Board_ptr clone() const = 0;
 
@@ -146,6 +160,7 @@ private:
 
     mutable std::array<int, Rank * Rank> parent;
     std::array<int, Rank * Rank> liberties;
+    std::array<std::uint16_t, Rank * Rank> neighborhood {};
 
     constexpr auto _liberties(Position p, Board<Rank>& visit) const -> bool
     {
@@ -174,6 +189,10 @@ private:
     {
         auto& self { *this };
         self[i] = r;
+        for (int k = 0; k < 8; k++) {
+            if (auto q { i + ring[k] }; in_border(q))
+                neighborhood[q.x * Rank + q.y] |= r.map(1, 2, 0) << (2 * (7 - k));
+        }
         auto neighbors = neighbor(i);
         int empty_around { 0 };
 
@@ -203,6 +222,10 @@ public:
     {
         for (int i = 0; i < Rank * Rank; i++) {
             parent[i] = i;
+            for (int k = 0; k < 8; k++) {
+                if (!in_border(Position { i / Rank, i % Rank } + ring[k]))
+                    neighborhood[i] |= 3 << (2 * k);
+            }
         }
     }
     Role& operator[](Position p) override { return arr[p.x * Rank + p.y]; }
@@ -248,6 +271,18 @@ public:
 
     auto get_rank() const -> int override { return Rank; }
 
+    auto pattern(Position p) const -> std::uint32_t override
+    {
+        auto& self { *this };
+        std::uint32_t code { neighborhood[p.x * Rank + p.y] };
+        for (int k = 0; k < 4; k++) {
+            auto q { p + ring[orthogonal_ring[k]] };
+            if (in_border(q) && self[q] && liberties[find(q.x * Rank + q.y)] <= 2)
+                code |= 1 << (16 + k);
+        }
+        return code;
+    }
+
     auto to_string() const -> std::string override
     {
         auto& self { *this };
@@ -267,6 +302,20 @@ public:
     }
 };
 
+_EXPORT inline auto make_board(int rank) -> Board_ptr
+{
+    switch (rank) {
+    case 9:
+        return std::make_shared<Board<9>>();
+    case 11:
+        return std::make_shared<Board<11>>();
+    case 13:
+        return std::make_shared<Board<13>>();
+    default:
+        throw std::logic_error { "not supported size" };
+    }
+}
+
 _EXPORT struct State {
     Board_ptr board {};
     Role role {};
@@ -0,0 +1,215 @@
+#pragma once
+#ifndef _EXPORT
+#define _EXPORT
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <random>
+#include <ranges>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <zlib.h>
+
+#include "bot.hpp"
+#include "log.hpp"
+#include "rule.hpp"
+
+// Self-play training data: a file of independent chunks, each a ChunkHeader followed by its
+// (optionally zlib-compressed) records. Every record is
+//   u8 rank, i8 side to move, i8 outcome for the side to move (1 win, -1 loss),
+//   ceil(rank * rank / 4) bytes of 2-bit points (0 empty, 1 black, 2 white; x * rank + y,
+//   low bits first), u8 n, then n * (u8 point, u16 root visits) for the searched moves.
+// Multi-byte fields are little endian.
+_EXPORT struct ChunkHeader {
+    static constexpr std::uint32_t MAGIC { 0x50534e4e }; // "NNSP"
+    static constexpr std::uint16_t COMPRESSED { 1 };
+    static constexpr std::size_t SIZE { 20 };
+
+    std::uint32_t magic { MAGIC };
+    std::uint16_t version { 1 };
+    std::uint16_t flags {};
+    std::uint32_t records {};
+    std::uint32_t stored_size {};
+    std::uint32_t raw_size {};
+
+    void write(std::ostream& os) const
+    {
+        std::array<std::uint8_t, SIZE> bytes;
+        auto put = [&, i = 0](auto field) mutable {
+            for (std::size_t k = 0; k < sizeof(field); k++)
+                bytes[i++] = field >> (8 * k);
+        };
+        put(magic), put(version), put(flags), put(records), put(stored_size), put(raw_size);
+        os.write(reinterpret_cast<const char*>(bytes.data()), SIZE);
+    }
+    static auto read(std::istream& is) -> ChunkHeader
+    {
+        std::array<std::uint8_t, SIZE> bytes;
+        if (!is.read(reinterpret_cast<char*>(bytes.data()), SIZE))
+            throw std::runtime_error { "truncated chunk header" };
+        ChunkHeader header;
+        auto get = [&, i = 0](auto& field) mutable {
+            field = 0;
+            for (std::size_t k = 0; k < sizeof(field); k++)
+                field |= std::remove_reference_t<decltype(field)>(bytes[i++]) << (8 * k);
+        };
+        get(header.magic), get(header.version), get(header.flags), get(header.records), get(header.stored_size), get(header.raw_size);
+        if (header.magic != MAGIC)
+            throw std::runtime_error { "not a self-play chunk" };
+        return header;
+    }
+};
+
+_EXPORT class SelfPlayFile {
+    std::string path;
+    std::atomic<std::uint64_t> end { 0 };
+
+public:
+    static constexpr std::size_t CHUNK_SIZE { 1 << 20 };
+
+    explicit SelfPlayFile(std::string path)
+        : path(std::move(path))
+    {
+        if (!std::ofstream { this->path, std::ios::binary | std::ios::trunc })
+            throw std::runtime_error { "cannot create " + this->path };
+    }
+
+    // Buffers records of one thread. A full chunk reserves its byte range with a single
+    // fetch_add on the file end and is written through this writer's own stream, so the
+    // workers never wait for each other.
+    class Writer {
+        SelfPlayFile& file;
+        std::ofstream os;
+        bool compress;
+        std::vector<std::uint8_t> buffer, compressed;
+        std::uint32_t records { 0 };
+
+    public:
+        Writer(SelfPlayFile& file, bool compress)
+            : file(file)
+            , os(file.path, std::ios::binary | std::ios::in | std::ios::out)
+            , compress(compress)
+        {
+            buffer.reserve(CHUNK_SIZE + 1024);
+        }
+        ~Writer()
+        {
+            flush();
+        }
+
+        void append(const State& state, Role outcome, const std::vector<std::pair<Position, int>>& visits)
+        {
+            auto rank { state.board->get_rank() };
+            buffer.push_back(rank);
+            buffer.push_back(state.role.id);
+            buffer.push_back(outcome == state.role ? 1 : -1);
+            auto offset { buffer.size() };
+            buffer.resize(offset + (rank * rank + 3) / 4);
+            for (int x = 0; x < rank; x++) {
+                for (int y = 0; y < rank; y++) {
+                    auto i { x * rank + y };
+                    buffer[offset + i / 4] |= (*state.board)[{ x, y }].map(1, 2, 0) << (2 * (i % 4));
+                }
+            }
+            buffer.push_back(visits.size());
+            for (auto [pos, visit] : visits) {
+                visit = std::min(visit, 0xffff);
+                buffer.push_back(pos.x * rank + pos.y);
+                buffer.push_back(visit & 0xff);
+                buffer.push_back(visit >> 8);
+            }
+            records++;
+            if (buffer.size() >= CHUNK_SIZE)
+                flush();
+        }
+
+        void flush()
+        {
+            if (!records)
+                return;
+            ChunkHeader header { .records = records, .raw_size = std::uint32_t(buffer.size()) };
+            auto payload { buffer.data() };
+            header.stored_size = buffer.size();
+            if (compress) {
+                auto size { compressBound(buffer.size()) };
+                compressed.resize(size);
+                if (compress2(compressed.data(), &size, buffer.data(), buffer.size(), Z_BEST_SPEED) == Z_OK) {
+                    header.flags |= ChunkHeader::COMPRESSED;
+                    header.stored_size = size;
+                    payload = compressed.data();
+                }
+            }
+            auto offset { file.end.fetch_add(ChunkHeader::SIZE + header.stored_size) };
+            os.seekp(offset);
+            header.write(os);
+            os.write(reinterpret_cast<const char*>(payload), header.stored_size);
+            os.flush();
+            buffer.clear();
+            records = 0;
+        }
+    };
+};
+
+// Bot-versus-bot games on every core. The first few moves of a game are sampled in
+// proportion to the root visits so that games diverge; after that the most visited move
+// is played.
+_EXPORT void run_selfplay(const std::string& path, int games, int board_size, bool compress)
+{
+    static constexpr auto sampled_moves { 8 };
+    // throws here rather than in the workers
+    auto empty_board { make_board(board_size) };
+    MCTSOptions options { .C = 1.5, .policy = LeafPolicy::PLAYOUT, .pattern_priors = true, .time_limit = 1h, .iterations = 200 };
+    if (value_network && value_network->rank == board_size)
+        options.policy = LeafPolicy::NETWORK;
+
+    SelfPlayFile file { path };
+    std::atomic<int> next_game { 0 };
+    std::atomic<std::uint64_t> positions { 0 };
+    auto start { chrono::steady_clock::now() };
+
+    auto worker = [&] {
+        SelfPlayFile::Writer writer { file, compress };
+        for (int game; (game = next_game++) < games;) {
+            State state { empty_board->clone() };
+            std::vector<std::pair<State, std::vector<std::pair<Position, int>>>> history;
+            for (;;) {
+                auto root { mcts_search(state, options) };
+                if (root->children.empty())
+                    break;
+                std::vector<std::pair<Position, int>> visits;
+                for (auto& child : root->children)
+                    visits.emplace_back(child->state.last_move, child->visit);
+                auto chosen { ranges::max_element(visits, std::less {}, [](auto& v) { return v.second; })->first };
+                if (std::ssize(history) < sampled_moves) {
+                    auto weights { visits | std::views::values };
+                    std::discrete_distribution<std::size_t> pick(weights.begin(), weights.end());
+                    chosen = visits[pick(rng)].first;
+                }
+                history.emplace_back(state, std::move(visits));
+                state = state.next_state(chosen);
+            }
+            auto winner { -state.role };
+            for (auto& [position, visits] : history)
+                writer.append(position, winner, visits);
+            positions += history.size();
+            if (game % 100 == 99) {
+                auto seconds { chrono::duration<double>(chrono::steady_clock::now() - start).count() };
+                logger->info("selfplay: {} games, {} positions, {:.0f} positions/h", game + 1, positions.load(), positions / seconds * 3600);
+            }
+        }
+    };
+    std::vector<std::jthread> workers;
+    for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); i++)
+        workers.emplace_back(worker);
+}
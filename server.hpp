@@ -7,38 +7,49 @@
 #include <asio/io_context.hpp>
 #include <asio/ip/address.hpp>
 #include <asio/ip/tcp.hpp>
+#include <asio/post.hpp>
 #include <asio/read_until.hpp>
 #include <asio/redirect_error.hpp>
 #include <asio/signal_set.hpp>
 #include <asio/steady_timer.hpp>
-#include <asio/streambuf.hpp>
+#include <asio/strand.hpp>
 #include <asio/use_awaitable.hpp>
 #include <asio/write.hpp>
 
 #include <magic_enum.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <deque>
 #include <functional>
 #include <iostream>
 #include <mutex>
+#include <numeric>
 #include <optional>
 #include <queue>
 #include <ranges>
-#include <set>
 #include <stdexcept>
+#include <stop_token>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "analysis.hpp"
 #include "bot.hpp"
 #include "contest.hpp"
 #include "log.hpp"
 #include "message.hpp"
+#include "metrics.hpp"
+#include "timingwheel.hpp"
 #include "uimessage.hpp"
 #include "utility.hpp"
+#include "wire.hpp"
 
 using asio::awaitable;
 using asio::co_spawn;
@@ -54,36 +65,146 @@ using std::chrono::system_clock;
 
 using std::operator""sv;
 
-static auto TIMEOUT { 30s };
+// the turn time limit of new contests, set by the local client's SYNC_ONLINE_SETTINGS_OP from
+// any room and read by all of them
+static std::atomic<seconds> TIMEOUT { 30s };
+// longest accepted message, excluding its newline
+static std::size_t MAX_FRAME_SIZE { 64 * 1024 };
+
+// What Participant::enqueue() does when a write queue exceeds its limits.
+enum class SlowConsumerPolicy {
+    COLLAPSE, // drop UI states and analysis results that newer ones supersede
+    PRIORITY_ONLY, // drop all is_bulk() messages
+    DISCONNECT,
+};
+// per connection; a remote peer still over them after the policy ran is disconnected
+static std::size_t MAX_QUEUED_MESSAGES { 1024 };
+static std::size_t MAX_QUEUED_BYTES { 4 << 20 };
+static SlowConsumerPolicy SLOW_CONSUMER_POLICY { SlowConsumerPolicy::COLLAPSE };
+// bulk bytes per second to each remote peer, 0 for no limit; see Participant::writer()
+static std::size_t BULK_BYTES_PER_SECOND { 1 << 20 };
+static constexpr std::size_t BULK_BURST { 64 * 1024 };
+// 0s for none: remote peers that send nothing for IDLE_TIMEOUT are disconnected, requests
+// nobody answers within REQUEST_TIMEOUT are dropped
+static seconds IDLE_TIMEOUT { 0s };
+static seconds REQUEST_TIMEOUT { 0s };
+// 0 for none: serves metrics.to_prometheus() on 127.0.0.1:METRICS_PORT/metrics
+static asio::ip::port_type METRICS_PORT { 0 };
+// leaf policy of the room bot when value_network does not fit the board: MOBILITY or PLAYOUT
+static LeafPolicy BOT_POLICY { LeafPolicy::MOBILITY };
 
 class Room;
 
+// Bytes a writer may send now: refilled at rate per second up to burst, unlimited for a rate
+// of 0. A write may take more than there is, and the debt is paid off before the next one.
+struct TokenBucket {
+    using clock = std::chrono::steady_clock;
+
+    double rate, burst;
+    double tokens { burst };
+    clock::time_point refilled { clock::now() };
+
+    void refill(clock::time_point now)
+    {
+        tokens = std::min(burst, tokens + std::chrono::duration<double>(now - refilled).count() * rate);
+        refilled = now;
+    }
+    auto available() const -> bool { return rate <= 0 || tokens > 0; }
+    void take(std::size_t bytes) { tokens -= bytes; }
+    // until available(), for a limited bucket
+    auto wait() const -> clock::duration
+    {
+        return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((1 - tokens) / rate));
+    }
+};
+
+// A message serialised once for every spectator of a room, in both encodings; the writers
+// send it from here.
+struct SharedFrame {
+    OpCode op;
+    std::string json, binary;
+
+    explicit SharedFrame(const Message& msg)
+        : op(msg.op)
+    {
+        msg.append_to(json);
+        json += '\n';
+        wire::append_binary(binary, msg);
+    }
+};
+using SharedFrame_ptr = std::shared_ptr<const SharedFrame>;
+
+// Runs on the strand of its socket (reader, writer, write queues); everything that touches
+// the room is posted to the room's strand.
 class Participant : public std::enable_shared_from_this<Participant> {
 public:
     Player player;
-    Room& room;
+    std::shared_ptr<Room> room; // replaced only by enter_room(), under room_mutex
+    std::mutex room_mutex;
     bool is_local;
 
     tcp::socket socket;
     asio::steady_timer timer;
-    std::deque<Message> write_msgs;
+    std::deque<Message> write_msgs; // control messages, and everything for the local participant
+    std::deque<Message> bulk_msgs; // is_bulk() messages for remote peers, rate limited
+    std::deque<SharedFrame_ptr> shared_msgs; // spectators: what the room sends to all of them
+    bool binary {}; // write wire::append_binary frames, see protocol()
+
+    // of write_msgs and bulk_msgs, readable from any thread
+    struct QueueMetrics {
+        std::atomic<std::size_t> messages, bytes, peak_messages, peak_bytes, dropped;
+    } queue_metrics {};
+    std::atomic<bool> stopping {};
+    static inline std::atomic<std::uint64_t> next_id { 1 };
+    bool ui_delta {}; // receives UI_STATE_DELTA_OP, see Room::deliver_ui_state(); room strand
+    bool spectator {}; // in Room::spectators rather than Room::participants; room strand
+    std::optional<TimingWheel::Timer> idle_timer; // socket strand, see watch_idle()
+    std::atomic<TimingWheel::clock::rep> last_read {};
+    std::size_t reported_bytes {}; // queue_metrics.bytes as counted in metrics.queued_bytes; socket strand
+    // the queue sizes that run shed_load(), raised while what it leaves cannot be dropped, and
+    // whether the queues went over their limits since they last drained to half; socket strand
+    std::size_t shed_messages { MAX_QUEUED_MESSAGES }, shed_bytes { MAX_QUEUED_BYTES };
+    bool overloaded {};
+
+    auto current_room() -> std::shared_ptr<Room>
+    {
+        std::lock_guard guard { room_mutex };
+        return room;
+    }
 
     awaitable<void> reader();
     awaitable<void> writer();
+    void enqueue(Message msg);
+    void enqueue(SharedFrame_ptr frame);
+    void update_queue_metrics();
+    void report_queued_bytes();
+    void shed_load();
+    void check_recovered();
+    void watch_idle();
+
+    // what a message takes in a write queue, roughly
+    static auto queued_size(const Message& msg) -> std::size_t
+    {
+        return sizeof(Message) + msg.data1.size() + msg.data2.size();
+    }
 
 public:
-    std::string name;
+    std::string name; // changed through ParticipantRegistry::rename() while in a room
+    const std::uint64_t id { next_id++ }; // session id, unique in this process
 
-    Participant(tcp::socket socket, Room& room, string name)
+    Participant(tcp::socket socket, std::shared_ptr<Room> room, string name)
         : room(room)
         , socket(std::move(socket))
         , timer(socket.get_executor())
         , name(name)
     {
         timer.expires_at(std::chrono::steady_clock::time_point::max());
+        metrics.participants.add();
     }
     virtual ~Participant()
     {
+        metrics.participants.add(-1);
+        metrics.queued_bytes.add(-std::int64_t(reported_bytes));
     }
     bool operator==(const Participant& participant) const
     {
@@ -102,15 +223,35 @@ public:
 
     void start();
     void stop();
+    void create_room(string_view, string_view);
+    void join_room(string_view, string_view);
+    void room_result(string_view, string_view)
+    {
+        throw std::logic_error { "Participant should not send room_result" };
+    }
+    void spectate(string_view, string_view);
+    void enter_room(std::shared_ptr<Room> target, bool as_spectator = false);
+    template <typename F>
+    void post_to_room(F f);
+
     void deliver(const Message& msg)
     {
-        logger->info("deliver: {} to {}", msg.to_string(), ::to_string(endpoint()));
-        write_msgs.push_back(msg);
-        timer.cancel_one();
+        LOG_TRACE("deliver: {} to {}", msg.to_string(), ::to_string(endpoint()));
+        asio::post(socket.get_executor(), [participant = weak_from_this(), msg] {
+            if (auto self { participant.lock() })
+                self->enqueue(std::move(msg));
+        });
+    }
+    void deliver(SharedFrame_ptr frame)
+    {
+        asio::post(socket.get_executor(), [participant = weak_from_this(), frame = std::move(frame)] {
+            if (auto self { participant.lock() })
+                self->enqueue(std::move(frame));
+        });
     }
     void shutdown()
     {
-        logger->debug("shutdown: {}", ::to_string(endpoint()));
+        LOG_DEBUG("shutdown: {}", ::to_string(endpoint()));
         asio::error_code ec;
         socket.shutdown(tcp::socket::shutdown_both, ec);
     }
@@ -170,6 +311,40 @@ public:
     virtual void replay_stop_move(string_view, string_view) = 0;
 
     virtual void bot_hosting(string_view, string_view) = 0;
+    virtual void analysis(string_view, string_view) = 0;
+    virtual void protocol(string_view, string_view) = 0;
+    void analysis_result(string_view, string_view)
+    {
+        throw std::logic_error { "Participant should not send analysis_result" };
+    }
+    void ui_state_delta(string_view, string_view)
+    {
+        throw std::logic_error { "Participant should not send ui_state_delta" };
+    }
+    virtual void ui_state_sync(string_view, string_view) = 0;
+    void dump_metrics(string_view data1, string_view)
+    {
+        if (!is_local)
+            throw std::logic_error { "Remote participant should not ask for metrics" };
+        deliver({ OpCode::METRICS_OP, "", metrics.to_json().dump() });
+        if (data1 == "reset")
+            metrics.reset();
+    }
+    // only what the build kept: LOG_DEBUG and LOG_TRACE are compiled out of release builds
+    void log_level(string_view data1, string_view)
+    {
+        if (!is_local)
+            throw std::logic_error { "Remote participant should not set the log level" };
+        if (!data1.empty()) {
+            auto level { parse_log_level(data1) };
+            if (!level)
+                throw std::logic_error { fmt::format("Unknown log level: {}", data1) };
+            logger->set_level(*level);
+            logger->info("log level set to {}", data1);
+        }
+        auto level { spdlog::level::to_string_view(logger->level()) };
+        deliver({ OpCode::LOG_LEVEL_OP, string_view { level.data(), level.size() } });
+    }
 };
 
 template <>
@@ -182,30 +357,277 @@ struct fmt::formatter<Participant> : fmt::formatter<std::string> {
 
 _EXPORT using Participant_ptr = std::shared_ptr<Participant>;
 
-class Room {
+// The participants of a room with an index for every lookup the handlers make: by session
+// id, by name, by the endpoint of remote peers (a local participant's endpoint is the
+// listener's) and by the address of unnamed ones. Used on the room's strand only.
+class ParticipantRegistry {
+    struct EndpointHash {
+        auto operator()(const tcp::endpoint& endpoint) const -> std::size_t
+        {
+            auto address { endpoint.address() };
+            std::size_t hash { endpoint.port() };
+            if (address.is_v4()) {
+                hash ^= std::size_t { address.to_v4().to_uint() } << 16;
+            } else {
+                for (auto byte : address.to_v6().to_bytes())
+                    hash = hash * 131 + byte;
+            }
+            return hash;
+        }
+    };
+
+    std::unordered_map<std::uint64_t, Participant_ptr> by_id;
+    std::unordered_multimap<std::string, Participant_ptr> by_name, by_address;
+    std::unordered_map<tcp::endpoint, Participant_ptr, EndpointHash> by_endpoint;
+    std::vector<Participant_ptr> locals; // in joining order
+
+    static void erase_from(auto& index, const auto& key, const Participant_ptr& participant)
+    {
+        auto [begin, end] { index.equal_range(key) };
+        for (auto it { begin }; it != end; it++) {
+            if (it->second == participant) {
+                index.erase(it);
+                return;
+            }
+        }
+    }
+    void index_name(const Participant_ptr& participant)
+    {
+        if (participant->name.empty())
+            by_address.emplace(participant->endpoint().address().to_string(), participant);
+        else
+            by_name.emplace(participant->name, participant);
+    }
+    void unindex_name(const Participant_ptr& participant)
+    {
+        if (participant->name.empty())
+            erase_from(by_address, participant->endpoint().address().to_string(), participant);
+        else
+            erase_from(by_name, participant->name, participant);
+    }
+
+public:
+    auto insert(const Participant_ptr& participant) -> bool
+    {
+        if (!by_id.emplace(participant->id, participant).second)
+            return false;
+        index_name(participant);
+        if (participant->is_local)
+            locals.push_back(participant);
+        else
+            by_endpoint.emplace(participant->endpoint(), participant);
+        return true;
+    }
+    auto erase(const Participant_ptr& participant) -> bool
+    {
+        if (!by_id.erase(participant->id))
+            return false;
+        unindex_name(participant);
+        if (participant->is_local)
+            std::erase(locals, participant);
+        else
+            by_endpoint.erase(participant->endpoint());
+        return true;
+    }
+    void erase_if(auto&& predicate)
+    {
+        std::vector<Participant_ptr> erased;
+        for (auto& [id, participant] : by_id) {
+            if (predicate(participant))
+                erased.push_back(participant);
+        }
+        for (auto& participant : erased)
+            erase(participant);
+    }
+    void rename(const Participant_ptr& participant, string name)
+    {
+        auto indexed { contains(participant) };
+        if (indexed)
+            unindex_name(participant);
+        participant->name = std::move(name);
+        if (indexed)
+            index_name(participant);
+    }
+
+    auto contains(const Participant_ptr& participant) const -> bool
+    {
+        return by_id.contains(participant->id);
+    }
+    auto find(std::uint64_t id) const -> Participant_ptr
+    {
+        auto it { by_id.find(id) };
+        return it == by_id.end() ? nullptr : it->second;
+    }
+    auto find_by_name(string_view name) const -> Participant_ptr
+    {
+        auto it { by_name.find(string { name }) };
+        return it == by_name.end() ? nullptr : it->second;
+    }
+    auto find_by_endpoint(const tcp::endpoint& endpoint) const -> Participant_ptr
+    {
+        auto it { by_endpoint.find(endpoint) };
+        return it == by_endpoint.end() ? nullptr : it->second;
+    }
+    // unnamed participants at address
+    auto find_unnamed(string_view address) const
+    {
+        auto [begin, end] { by_address.equal_range(string { address }) };
+        return std::ranges::subrange(begin, end) | std::views::values;
+    }
+    auto local() const -> Participant_ptr
+    {
+        return locals.empty() ? nullptr : locals.front();
+    }
+
+    auto size() const { return by_id.size(); }
+    auto empty() const { return by_id.empty(); }
+    auto begin() const { return (by_id | std::views::values).begin(); }
+    auto end() const { return (by_id | std::views::values).end(); }
+};
+
+// All rooms of the server by name. Connections start in the lobby, the room named "", which
+// lives as long as the server; any other room is dropped once its last participant leaves.
+class RoomRegistry {
+    asio::io_context& io_context;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<Room>> rooms;
+    int created { 0 };
+
+public:
+    const std::shared_ptr<TimingWheel> timers; // every timeout of the server
+
+    RoomRegistry(asio::io_context& io_context);
+
+    auto lobby() -> std::shared_ptr<Room>
+    {
+        std::lock_guard guard { mutex };
+        return rooms.at("");
+    }
+    auto find(string_view name) -> std::shared_ptr<Room>
+    {
+        std::lock_guard guard { mutex };
+        auto room { rooms.find(string { name }) };
+        return room == rooms.end() ? nullptr : room->second;
+    }
+    // false once released, even if a new room took its name
+    auto contains(const Room& room) -> bool;
+    // an empty name is replaced by a generated one
+    auto create(string name) -> std::shared_ptr<Room>;
+    void release(Room& room);
+    auto size() -> std::size_t
+    {
+        std::lock_guard guard { mutex };
+        return rooms.size();
+    }
+};
+
+// All state of a room is used on its strand only, except where noted.
+class Room : public std::enable_shared_from_this<Room> {
 public:
     Contest contest;
     std::deque<std::string> chats;
     Participant_ptr my_request;
     std::deque<Participant_ptr> received_requests;
     std::mutex bot_mutex;
+    std::vector<UiMessage::DynamicStatistics> statistics; // of the latest bot search
+    system_clock::time_point statistics_game; // the contest.start_time of that search
+    std::optional<UiMessage::UiState> ui_state; // the last one sent as UI_STATE_DELTA_OP
+    std::uint64_t ui_version {};
+    bool ui_pending {}, ui_full {}; // see deliver_ui_state()
 
     Participant_ptr find_local_participant()
     {
-        auto p = ranges::find_if(participants, [](auto participant) { return participant->is_local; });
-        if (p == participants.end())
+        auto participant { participants.local() };
+        if (!participant)
             throw std::logic_error("no local participant");
-        return *p;
+        return participant;
     }
 
     void deliver_to_local(const Message& msg)
     {
+        flush_pending_ui_state();
         find_local_participant()->deliver(msg);
     }
 
-    void deliver_ui_state()
+    // safe from any strand
+    auto has_local_participant() const -> bool
+    {
+        return local_participants > 0;
+    }
+
+    // Marks the UI state dirty. It is sent once, after the handler running on the strand
+    // returns, so a turn that changes the contest several times pushes only the last state.
+    // A message the room delivers meanwhile sends it first, keeping the order of the two.
+    void deliver_ui_state(bool full = false)
+    {
+        ui_full |= full;
+        if (ui_pending)
+            return;
+        ui_pending = true;
+        asio::post(strand, [self = shared_from_this()] { self->flush_pending_ui_state(); });
+    }
+
+    void flush_pending_ui_state()
+    {
+        if (!ui_pending)
+            return;
+        try {
+            StageTimer timing { ServerMetrics::Stage::UI_STATE, OpCode::UPDATE_UI_STATE_OP };
+            flush_ui_state();
+        } catch (std::exception& e) {
+            logger->error("deliver_ui_state: {}", e.what());
+        }
+    }
+
+    // Participants that asked with UI_STATE_SYNC_OP get UI_STATE_DELTA_OP instead of full
+    // UPDATE_UI_STATE_OP: data1 is the version of the new state and data2 either
+    // {"base": version, changes...} (see UiState::delta) or {"snapshot": state}. A client
+    // whose version is not the base resynchronises.
+    void flush_ui_state()
+    {
+        auto full { std::exchange(ui_full, false) };
+        ui_pending = false;
+        // telemetry ends with its game
+        if (contest.status != Contest::Status::ON_GOING || statistics_game != contest.start_time)
+            statistics.clear();
+        UiMessage::UiState state { contest, statistics };
+        if (!spectators.empty())
+            deliver_to_spectators(UiMessage { state });
+        auto participant { find_local_participant() };
+        if (!participant->ui_delta) {
+            participant->deliver(UiMessage { state });
+            return;
+        }
+        string data;
+        if (auto delta { !full && ui_state ? state.delta(*ui_state, ui_version) : std::nullopt }) {
+            if (delta->empty())
+                return;
+            data = std::move(*delta);
+        } else {
+            data = R"({"snapshot":)";
+            state.write(data);
+            data += '}';
+        }
+        participant->deliver({ OpCode::UI_STATE_DELTA_OP, std::to_string(++ui_version), data });
+        ui_state = std::move(state);
+    }
+
+    // Reports of a bot that no longer plays, or that searched in an earlier game, are dropped.
+    void update_statistics(const Player& player, system_clock::time_point game, const SearchTelemetry& telemetry)
     {
-        deliver_to_local(UiMessage { contest });
+        if (game != contest.start_time || !should_bot_move(player) || contest.players.at(player.role).type != PlayerType::BOT_PLAYER)
+            return;
+        statistics = {
+            { "iterations_per_second", "Iterations/s", fmt::format("{:.0f}", telemetry.iterations_per_second) },
+            { "tree_size", "Tree size", std::to_string(telemetry.tree_size) },
+        };
+        // none for MOBILITY, whose rewards are not results
+        if (telemetry.winrate)
+            statistics.push_back({ "winrate", "Win rate", fmt::format("{:.1f}%", *telemetry.winrate * 100) });
+        statistics.push_back({ "confidence", "Confidence", fmt::format("{:.1f}%", telemetry.confidence * 100) });
+        statistics.push_back({ "time", "Time", fmt::format("{}ms", telemetry.elapsed.count()) });
+        statistics_game = game;
+        deliver_ui_state();
     }
 
     constexpr auto is_local_contest() -> bool
@@ -220,6 +642,8 @@ public:
             return;
         if (player.type == PlayerType::BOT_PLAYER) {
             player.type = PlayerType::LOCAL_HUMAN_PLAYER;
+            statistics.clear();
+            deliver_ui_state();
         } else {
             player.type = PlayerType::BOT_PLAYER;
             check_bot(player, is_local_game);
@@ -228,9 +652,8 @@ public:
 
     auto do_move(const Player& player, Position pos, bool is_local_game = false)
     {
-        logger->debug("do_move: player = {}, pos = {}, is_local_game = {}", player.to_string(), pos.to_string(), std::to_string(is_local_game));
-        timer_cancelled = true;
-        timer.cancel();
+        LOG_DEBUG("do_move: player = {}, pos = {}, is_local_game = {}", player.to_string(), pos.to_string(), std::to_string(is_local_game));
+        turn_timer.cancel();
 
         Player opponent;
         try {
@@ -250,6 +673,10 @@ public:
             logger->error("Ignore move: {}, player:{}", e.what(), player.to_string());
             return false;
         }
+        metrics.moves.add();
+        if (contest.status == Contest::Status::GAME_OVER)
+            metrics.games.add();
+        stop_analysis();
 
         if (!is_local_game) {
             if (contest.status == Contest::Status::GAME_OVER) {
@@ -258,19 +685,16 @@ public:
         }
 
         if (contest.status == Contest::Status::ON_GOING) {
-            timer_cancelled = false;
-            timer.expires_after(contest.duration);
-            timer.async_wait([=](const asio::error_code& ec) {
-                if (!ec && !timer_cancelled) {
-                    logger->debug("timeout: player = {}", player.to_string());
-                    contest.timeout(opponent);
-                    if (!is_local_game) {
-                        if (contest.status == Contest::Status::GAME_OVER) {
-                            player.participant->process_game_over();
-                        }
+            turn_timer.expires_after(contest.duration, [=, this] {
+                LOG_DEBUG("timeout: player = {}", player.to_string());
+                contest.timeout(opponent);
+                metrics.games.add();
+                if (!is_local_game) {
+                    if (contest.status == Contest::Status::GAME_OVER) {
+                        player.participant->process_game_over();
                     }
-                    deliver_ui_state();
                 }
+                deliver_ui_state();
             });
         }
 
@@ -280,7 +704,7 @@ public:
         return true;
     }
 
-    auto should_bot_move(const Player& player) const
+    auto should_bot_move(const Player& player) const -> bool
     {
         auto participant { player.participant };
 
@@ -292,34 +716,105 @@ public:
 
     void check_bot(const Player& player, bool is_local_game = false)
     {
-        logger->debug("check_bot: player = {}, is_local_game = {}", player.to_string(), std::to_string(is_local_game));
+        LOG_DEBUG("check_bot: player = {}, is_local_game = {}", player.to_string(), std::to_string(is_local_game));
 
         if (!should_bot_move(player))
             return;
 
         logger->info("check_bot: start bot");
-        auto bot = [&](const State& state, Player player, bool is_local_game = false) {
+        auto bot = [this, self = shared_from_this(), game = contest.start_time](const State& state, Player player, bool is_local_game = false) {
             std::lock_guard<std::mutex> guard(bot_mutex);
             logger->info("bot start calcing move, player = {}", player.to_string());
-            Position pos = mcts_bot_player(state);
+            metrics.bot_jobs.add();
+            auto start { std::chrono::steady_clock::now() };
+            auto elapsed = [&] { return std::chrono::duration_cast<milliseconds>(std::chrono::steady_clock::now() - start); };
+            auto iterations { 0 };
+            // once a second while searching, and once with the final tree
+            auto report = [&](const MCTSNode& root) {
+                metrics.search_iterations.add(root.visit - std::exchange(iterations, root.visit));
+                asio::post(strand, [self, player, game, telemetry = SearchTelemetry { root, elapsed() }] {
+                    try {
+                        self->update_statistics(player, game, telemetry);
+                    } catch (std::exception& e) {
+                        logger->error("report statistics: {}", e.what());
+                    }
+                });
+            };
+            auto bot_player { BOT_POLICY == LeafPolicy::PLAYOUT ? &mcts_playout_bot_player : &mcts_bot_player };
+            if (value_network && value_network->rank == state.board->get_rank())
+                bot_player = &mcts_network_bot_player;
+            Position pos = (*bot_player)(state, report);
+            metrics.bot_jobs.add(-1);
             if (pos) {
                 logger->info("bot finish calcing move, player = {}, pos = {}", player.to_string(), pos.to_string());
-                if (should_bot_move(player)) {
-                    if (do_move(player, pos, is_local_game)) {
-                        deliver_to_others({ OpCode::MOVE_OP, pos.to_string() }, player.participant);
+                asio::post(strand, [self, player, pos, is_local_game] {
+                    try {
+                        if (self->should_bot_move(player) && self->do_move(player, pos, is_local_game))
+                            self->deliver_to_others({ OpCode::MOVE_OP, pos.to_string() }, player.participant);
+                    } catch (std::exception& e) {
+                        logger->error("bot move: {}", e.what());
                     }
-                }
+                });
             } else {
                 logger->error("bot failed to calc move, player = {}", player.to_string());
             }
         };
-        std::thread bot_thread { bot, std::ref(contest.current), player, is_local_game };
+        State state { contest.current.board->clone(), contest.current.role, contest.current.last_move };
+        std::thread bot_thread { bot, std::move(state), player, is_local_game };
         bot_thread.detach();
     }
 
-    auto receive_participant_name(Participant_ptr participant, std::string_view name)
+    // Searches a copy of the current position on its own thread and posts the top_k
+    // candidates to the local participant every interval, and once more when it ends.
+    void start_analysis(int top_k, milliseconds time_limit, milliseconds interval = 500ms)
     {
-        auto new_name { name };
+        stop_analysis();
+        if (top_k <= 0)
+            return;
+        auto generation { analysis_generation.load() };
+        State state { contest.current.board->clone(), contest.current.role, contest.current.last_move };
+        logger->info("start_analysis: top_k = {}, time_limit = {}ms", top_k, time_limit.count());
+
+        // detached, so that stopping never waits on the strand; it only keeps the room weakly
+        analysis_stop = {};
+        std::thread { [=, strand = strand, room = weak_from_this(), stop = analysis_stop.get_token()] {
+            auto iterations { 0 };
+            auto post = [&](const MCTSNode& root, string_view phase) {
+                metrics.search_iterations.add(root.visit - std::exchange(iterations, root.visit));
+                Message msg { OpCode::ANALYSIS_RESULT_OP, phase, json(analyse(root, top_k)).dump() };
+                asio::post(strand, [=] {
+                    // results of a search that was stopped meanwhile are stale
+                    auto self { room.lock() };
+                    if (!self || generation != self->analysis_generation)
+                        return;
+                    try {
+                        self->deliver_to_local(msg);
+                    } catch (std::exception& e) {
+                        logger->error("analysis: {}", e.what());
+                    }
+                });
+            };
+            auto options { analysis_options(state, time_limit) };
+            metrics.bot_jobs.add();
+            auto root { mcts_search(state, options, stop, [&](const MCTSNode& root) { post(root, "running"); }, interval) };
+            metrics.bot_jobs.add(-1);
+            if (!stop.stop_requested())
+                post(*root, "done");
+            else
+                metrics.search_iterations.add(root->visit - iterations);
+        } }.detach();
+    }
+
+    // the search ends at its next iteration, on its own thread
+    void stop_analysis()
+    {
+        analysis_generation++;
+        analysis_stop.request_stop();
+    }
+
+    auto receive_participant_name(Participant_ptr participant, std::string_view name) -> string
+    {
+        string new_name { name };
 
         if (!Player::is_valid_name(name)) {
             if (participant->name.empty())
@@ -331,7 +826,7 @@ public:
         if (new_name != participant->name) {
             if (!participant->is_local && !participant->name.empty() && participant->name != ::to_string(participant->endpoint()))
                 deliver_to_local({ OpCode::CHAT_USERNAME_UPDATE_OP, participant->name, new_name });
-            participant->name = new_name;
+            participants.rename(participant, new_name);
         }
 
         return new_name;
@@ -339,21 +834,72 @@ public:
 
     void reject_all_received_requests(string_view name)
     {
-        logger->debug("reject_all_received_requests");
-        ranges::for_each(received_requests, [=](auto& r) { if (name != r->name) r->deliver({ OpCode::REJECT_OP, find_local_participant()->name, "Already accepted other request" }); });
+        LOG_DEBUG("reject_all_received_requests");
+        ranges::for_each(received_requests, [=, this](auto& r) { if (name != r->name) r->deliver({ OpCode::REJECT_OP, find_local_participant()->name, "Already accepted other request" }); });
         received_requests.clear();
+        received_request_timer.cancel();
+    }
+
+    // the front of received_requests, which waits for the local participant to answer
+    void show_received_request()
+    {
+        auto request { received_requests.front() };
+        deliver_to_local({ OpCode::RECEIVE_REQUEST_OP, request->name, request->player.role.map("b", "w", "") });
+        if (REQUEST_TIMEOUT == 0s)
+            return;
+        received_request_timer.expires_after(REQUEST_TIMEOUT, [room = weak_from_this(), request] {
+            auto self { room.lock() };
+            if (!self || self->received_requests.empty() || self->received_requests.front() != request)
+                return;
+            logger->info("request from {} expired", request->name);
+            self->received_requests.pop_front();
+            request->deliver({ OpCode::REJECT_OP, self->has_local_participant() ? self->find_local_participant()->name : "", "Request expired" });
+            if (!self->received_requests.empty() && self->has_local_participant())
+                self->show_received_request();
+        });
+    }
+    void send_request(Participant_ptr target)
+    {
+        my_request = target;
+        if (REQUEST_TIMEOUT == 0s)
+            return;
+        sent_request_timer.expires_after(REQUEST_TIMEOUT, [room = weak_from_this(), target] {
+            auto self { room.lock() };
+            if (!self || self->my_request != target)
+                return;
+            logger->info("request to {} expired", target->name);
+            self->my_request = nullptr;
+            self->deliver_to_local({ OpCode::RECEIVE_REQUEST_RESULT_OP, "rejected", target->name });
+        });
     }
 
 public:
-    Room(asio::io_context& io_context)
-        : timer { io_context }
+    Room(asio::io_context& io_context, RoomRegistry& registry, string name)
+        : strand { asio::make_strand(io_context) }
+        , turn_timer { registry.timers, strand }
+        , received_request_timer { registry.timers, strand }
+        , sent_request_timer { registry.timers, strand }
         , io_context { io_context }
+        , registry { registry }
+        , name { std::move(name) }
+    {
+    }
+    ~Room()
+    {
+        analysis_stop.request_stop();
+    }
+    static constexpr auto spectator_may_send(OpCode op) -> bool
     {
+        return op == OpCode::LEAVE_OP || op == OpCode::JOIN_ROOM_OP || op == OpCode::SPECTATE_OP || op == OpCode::PROTOCOL_OP;
     }
     void process_data(Message msg, Participant_ptr participant)
     {
-        logger->info("process_data: {} from {}", msg.to_string(), ::to_string(*participant));
+        LOG_TRACE("process_data: {} from {}", msg.to_string(), ::to_string(*participant));
         const string_view data1 { msg.data1 }, data2 { msg.data2 };
+        if (participant->spectator && !spectator_may_send(msg.op)) {
+            logger->warn("process_data: ignore {} from spectator {}", msg.to_string(), ::to_string(*participant));
+            return;
+        }
         switch (msg.op) {
         case OpCode::READY_OP:
             participant->ready(data1, data2);
@@ -461,100 +1007,300 @@ public:
             participant->bot_hosting(data1, data2);
             deliver_ui_state();
             break;
+        case OpCode::ANALYSIS_OP:
+            participant->analysis(data1, data2);
+            break;
+        case OpCode::ANALYSIS_RESULT_OP:
+            participant->analysis_result(data1, data2);
+            break;
+        // -------- Room --------
+        case OpCode::CREATE_ROOM_OP:
+            participant->create_room(data1, data2);
+            break;
+        case OpCode::JOIN_ROOM_OP:
+            participant->join_room(data1, data2);
+            break;
+        case OpCode::ROOM_RESULT_OP:
+            participant->room_result(data1, data2);
+            break;
+        // -------- Protocol --------
+        case OpCode::PROTOCOL_OP:
+            participant->protocol(data1, data2);
+            break;
+        // -------- UI State --------
+        case OpCode::UI_STATE_DELTA_OP:
+            participant->ui_state_delta(data1, data2);
+            break;
+        case OpCode::UI_STATE_SYNC_OP:
+            participant->ui_state_sync(data1, data2);
+            break;
+        case OpCode::SPECTATE_OP:
+            participant->spectate(data1, data2);
+            break;
+        case OpCode::METRICS_OP:
+            participant->dump_metrics(data1, data2);
+            break;
+        case OpCode::LOG_LEVEL_OP:
+            participant->log_level(data1, data2);
+            break;
         }
     }
+    void deliver_to_spectators(const Message& msg)
+    {
+        if (spectators.empty())
+            return;
+        auto frame { std::make_shared<const SharedFrame>(msg) };
+        for (auto& spectator : spectators)
+            spectator->deliver(frame);
+    }
+    // read-only: sees the UI states and the moves of the room, from the local side
+    void spectate(Participant_ptr participant)
+    {
+        logger->info("{} spectates room '{}', {} spectators", ::to_string(participant->endpoint()), name, spectators.size() + 1);
+        participant->spectator = true;
+        spectators.insert(participant);
+        participant->deliver(std::make_shared<const SharedFrame>(UiMessage { contest }));
+    }
     void join(Participant_ptr participant)
     {
-        logger->info("{}:{} join", participant->endpoint().address().to_string(), participant->endpoint().port());
-        participants.insert(participant);
+        logger->info("{}:{} join room '{}'", participant->endpoint().address().to_string(), participant->endpoint().port(), name);
+        if (participants.insert(participant) && participant->is_local)
+            local_participants++;
     }
 
     void leave(Participant_ptr participant)
     {
         logger->info("leave: {}:{} leave", participant->endpoint().address().to_string(), participant->endpoint().port());
-        if (participants.find(participant) == participants.end()) {
+        if (spectators.erase(participant)) {
+            participant->spectator = false;
+            if (participants.empty())
+                registry.release(*this);
+            return;
+        }
+        if (!participants.contains(participant)) {
             logger->info("leave: {}:{} not found", participant->endpoint().address().to_string(), participant->endpoint().port());
             return;
         }
-        logger->debug("leave: erase participant, participants.size() = {}", participants.size());
+        LOG_DEBUG("leave: erase participant, participants.size() = {}", participants.size());
         participants.erase(participant);
-        logger->debug("leave: erase end, participants.size() = {}", participants.size());
-        logger->debug("leave: remove all requests from {}:{} in received_requests", participant->endpoint().address().to_string(), participant->endpoint().port());
+        if (participant->is_local)
+            local_participants--;
+        LOG_DEBUG("leave: erase end, participants.size() = {}", participants.size());
+        LOG_DEBUG("leave: remove all requests from {}:{} in received_requests", participant->endpoint().address().to_string(), participant->endpoint().port());
 
         auto is_first { !received_requests.empty() && received_requests.front() == participant };
         std::erase(received_requests, participant);
 
-        if (is_first && !received_requests.empty()) {
-            logger->debug("leave: is_first && !received_requests.empty(), send received_requests.front() to local");
-            deliver_to_local({ OpCode::RECEIVE_REQUEST_OP, received_requests.front()->name, received_requests.front()->player.role.map("b", "w", "") });
+        if (is_first && !received_requests.empty() && has_local_participant()) {
+            LOG_DEBUG("leave: is_first && !received_requests.empty(), send received_requests.front() to local");
+            show_received_request();
         }
         if (participant == my_request) {
-            logger->debug("leave: my_request->receiver == participant, clear my_request");
+            LOG_DEBUG("leave: my_request->receiver == participant, clear my_request");
             my_request = nullptr;
         }
-        if (!participant->name.empty()) {
-            logger->debug("leave: participant->name is not empty, send LEAVE_OP to local");
+        if (!participant->name.empty() && has_local_participant()) {
+            LOG_DEBUG("leave: participant->name is not empty, send LEAVE_OP to local");
             deliver_to_local({ OpCode::LEAVE_OP, participant->name });
         }
+        if (participants.empty())
+            registry.release(*this);
     }
 
     void close_except(Participant_ptr participant)
     {
-        logger->debug("close_except: participants.size() = {}", participants.size());
+        LOG_DEBUG("close_except: participants.size() = {}", participants.size());
 
-        std::erase_if(participants, [&](auto p) { return p != participant; });
+        participants.erase_if([&](auto p) { return p != participant; });
+        local_participants = participant->is_local;
 
-        logger->debug("close_except: close {}", ::to_string(participant->endpoint()));
-        logger->debug("close_except: send LEAVE_OP");
+        LOG_DEBUG("close_except: close {}", ::to_string(participant->endpoint()));
+        LOG_DEBUG("close_except: send LEAVE_OP");
 
-        logger->debug("close_except: erase it");
-        logger->debug("close_except: end");
-        logger->debug("close_except: skip self");
+        LOG_DEBUG("close_except: erase it");
+        LOG_DEBUG("close_except: end");
+        LOG_DEBUG("close_except: skip self");
     }
 
     void deliver_to_others(Message msg, Participant_ptr participant)
     {
-        std::cout << "deliver to others: self = " << participant->endpoint() << std::endl;
-
+        flush_pending_ui_state();
         for (auto p : participants) {
             if (p != participant) {
-                logger->info("broadcast {} from {}:{}", msg.to_string(), participant->endpoint().address().to_string(), participant->endpoint().port());
+                LOG_TRACE("broadcast {} from {}", msg.to_string(), ::to_string(participant->endpoint()));
                 p->deliver(msg);
             }
         }
+        if (!is_bulk(msg.op))
+            deliver_to_spectators(msg);
     }
 
     void clear()
     {
         // TODO: only keep local session
-        std::erase_if(participants, [](auto p) { return !p->is_local; });
+        participants.erase_if([](auto p) { return !p->is_local; });
+        local_participants = participants.size();
     }
 
-    bool timer_cancelled {};
-    asio::steady_timer timer;
-    std::set<Participant_ptr> participants;
+    asio::strand<asio::io_context::executor_type> strand;
+    TimingWheel::Timer turn_timer;
+    TimingWheel::Timer received_request_timer, sent_request_timer; // see REQUEST_TIMEOUT
+    ParticipantRegistry participants;
+    std::unordered_set<Participant_ptr> spectators;
+    std::atomic<int> local_participants {};
     asio::io_context& io_context;
+    RoomRegistry& registry;
+    const std::string name;
+    std::atomic<int> analysis_generation {};
+    std::stop_source analysis_stop; // of the running analysis
 };
 
+RoomRegistry::RoomRegistry(asio::io_context& io_context)
+    : io_context { io_context }
+    , timers { std::make_shared<TimingWheel>(io_context) }
+{
+    rooms.emplace("", std::make_shared<Room>(io_context, *this, ""));
+    metrics.rooms.add();
+}
+
+auto RoomRegistry::create(string name) -> std::shared_ptr<Room>
+{
+    std::lock_guard guard { mutex };
+    while (name.empty() || rooms.contains(name))
+        name = "room" + std::to_string(++created);
+    auto room { std::make_shared<Room>(io_context, *this, name) };
+    rooms.emplace(name, room);
+    metrics.rooms.add();
+    logger->info("create room '{}', {} rooms", name, rooms.size());
+    return room;
+}
+
+void RoomRegistry::release(Room& room)
+{
+    if (room.name.empty() || !room.participants.empty() || !room.spectators.empty())
+        return;
+    // the players and requests hold their participants, which hold the room
+    room.stop_analysis();
+    room.turn_timer.cancel();
+    room.received_request_timer.cancel();
+    room.sent_request_timer.cancel();
+    room.contest = Contest {};
+    room.my_request = nullptr;
+    room.received_requests.clear();
+    std::lock_guard guard { mutex };
+    // a room released before can still be left by a participant whose join came too late
+    if (auto it { rooms.find(room.name) }; it != rooms.end() && it->second.get() == &room) {
+        logger->info("release room '{}', {} rooms", room.name, rooms.size() - 1);
+        rooms.erase(it);
+        metrics.rooms.add(-1);
+    }
+}
+auto RoomRegistry::contains(const Room& room) -> bool
+{
+    std::lock_guard guard { mutex };
+    auto it { rooms.find(room.name) };
+    return it != rooms.end() && it->second.get() == &room;
+}
+
+// f(room) on the strand of the room the participant is in when f runs: enter_room() may move
+// it to another room while the post is pending, and then f follows it there
+template <typename F>
+void Participant::post_to_room(F f)
+{
+    auto room { current_room() };
+    asio::post(room->strand, [room, self = shared_from_this(), f = std::move(f)]() mutable {
+        if (self->current_room() != room) {
+            self->post_to_room(std::move(f));
+            return;
+        }
+        f(room);
+    });
+}
+
 void Participant::move(string_view data1, string_view data2)
 {
     Position pos { data1 };
 
-    if (room.do_move(player, pos)) {
-        room.deliver_to_others({ OpCode::MOVE_OP, data1, data2 }, shared_from_this()); // broadcast
+    if (room->do_move(player, pos)) {
+        room->deliver_to_others({ OpCode::MOVE_OP, data1, data2 }, shared_from_this()); // broadcast
     }
 }
 
 awaitable<void> Participant::reader()
 {
-    asio::streambuf buffer;
-    std::istream stream(&buffer);
+    // Frames, JSON lines or wire.hpp binary frames, are parsed in place from one buffer per
+    // connection, every complete frame of a read before the next one. The buffer starts small
+    // and grows up to MAX_FRAME_SIZE; a partial frame is moved to its front.
+    const auto limit { MAX_FRAME_SIZE + 16 }; // room for the newline or binary header of the longest frame
+    std::vector<char> buffer(std::min<std::size_t>(4096, limit));
+    std::size_t begin { 0 }, scanned { 0 }, end { 0 };
     try {
-        for (std::string message;;) {
-            co_await asio::async_read_until(socket, buffer, '\n', use_awaitable);
-            std::getline(stream, message);
-            logger->info("Receive: {}", message);
-            room.process_data({ message }, shared_from_this());
+        for (;;) {
+            if (begin == end) {
+                begin = scanned = end = 0;
+            } else if (end == buffer.size()) {
+                if (begin > 0) {
+                    std::copy(buffer.begin() + begin, buffer.begin() + end, buffer.begin());
+                    scanned -= begin, end -= begin, begin = 0;
+                } else if (buffer.size() < limit) {
+                    buffer.resize(std::min(buffer.size() * 2, limit));
+                } else {
+                    throw std::length_error { "frame exceeds " + std::to_string(MAX_FRAME_SIZE) + " bytes" };
+                }
+            }
+            end += co_await socket.async_read_some(asio::buffer(buffer.data() + end, buffer.size() - end), use_awaitable);
+            last_read.store(TimingWheel::clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+
+            for (;;) {
+                string_view frame;
+                auto is_binary { begin != end && buffer[begin] == wire::BINARY_FRAME };
+                if (is_binary) {
+                    auto header { wire::read_header({ buffer.data() + begin + 1, end - begin - 1 }) };
+                    if (header && header->first > MAX_FRAME_SIZE)
+                        throw std::length_error { "frame exceeds " + std::to_string(MAX_FRAME_SIZE) + " bytes" };
+                    if (!header || end - begin < 1 + header->second + header->first)
+                        break;
+                    frame = { buffer.data() + begin + 1 + header->second, header->first };
+                    begin = scanned = frame.data() + frame.size() - buffer.data();
+                } else {
+                    auto newline { std::find(buffer.begin() + scanned, buffer.begin() + end, '\n') - buffer.begin() };
+                    if (std::size_t(newline - begin) > MAX_FRAME_SIZE)
+                        throw std::length_error { "frame exceeds " + std::to_string(MAX_FRAME_SIZE) + " bytes" };
+                    if (newline == end)
+                        break;
+                    frame = { buffer.data() + begin, newline - begin };
+                    begin = scanned = newline + 1;
+                    LOG_TRACE("Receive: {}", frame);
+                }
+                metrics.in.record(frame.size());
+                auto parsing { ServerMetrics::clock::now() };
+                Message msg;
+                try {
+                    msg = is_binary ? wire::parse_binary(frame) : Message { frame };
+                    metrics.record(ServerMetrics::Stage::PARSE, msg.op, ServerMetrics::clock::now() - parsing);
+                } catch (std::exception& e) {
+                    logger->error("Exception: {}", e.what());
+                    if (!is_local) {
+                        stop();
+                        co_return;
+                    }
+                    continue;
+                }
+                if (is_binary)
+                    LOG_TRACE("Receive: {}", msg.to_string());
+                post_to_room([self = shared_from_this(), msg = std::move(msg), received = ServerMetrics::clock::now()](const std::shared_ptr<Room>& room) mutable {
+                    metrics.record(ServerMetrics::Stage::WAIT, msg.op, ServerMetrics::clock::now() - received);
+                    try {
+                        StageTimer timing { ServerMetrics::Stage::HANDLE, msg.op };
+                        room->process_data(std::move(msg), self);
+                    } catch (std::exception& e) {
+                        logger->error("Exception: {}", e.what());
+                        if (!self->is_local)
+                            self->stop();
+                    }
+                });
+            }
+            scanned = end;
         }
     } catch (std::exception& e) {
         logger->error("Exception: {}", e.what());
@@ -564,20 +1310,83 @@ awaitable<void> Participant::reader()
 }
 awaitable<void> Participant::writer()
 {
+    // Every queued control message up to the next LEAVE_OP goes out in one write, followed
+    // by as many bulk messages as the token bucket allows and then the shared frames, which
+    // are written from where they are. A leaving peer gets all of its bulk messages and
+    // shared frames before the LEAVE_OP.
+    static constexpr std::size_t max_kept_capacity { 1 << 20 };
+    std::string buffer;
+    std::vector<SharedFrame_ptr> frames;
+    std::vector<asio::const_buffer> buffers;
+    std::size_t appended { 0 };
+    auto append = [&](const Message& msg) {
+        appended++;
+        if (binary) {
+            wire::append_binary(buffer, msg);
+        } else {
+            msg.append_to(buffer);
+            buffer += '\n';
+        }
+        // the peer reads binary frames once it has our acceptance
+        if (msg.op == OpCode::PROTOCOL_OP && msg.data2 == "accept")
+            binary = true;
+    };
+    TokenBucket bucket { double(BULK_BYTES_PER_SECOND), BULK_BURST };
     try {
         while (socket.is_open()) {
-            if (write_msgs.empty()) {
+            bucket.refill(TokenBucket::clock::now());
+            if (write_msgs.empty() && shared_msgs.empty() && (bulk_msgs.empty() || !bucket.available())) {
+                // woken by enqueue(), or when the bucket has refilled enough for bulk_msgs
+                if (bulk_msgs.empty())
+                    timer.expires_at(std::chrono::steady_clock::time_point::max());
+                else
+                    timer.expires_after(bucket.wait());
                 asio::error_code ec;
                 co_await timer.async_wait(redirect_error(use_awaitable, ec));
-            } else {
-                auto msg = write_msgs.front();
-                co_await asio::async_write(socket, asio::buffer(msg.to_string() + "\n"),
-                    use_awaitable);
-                write_msgs.pop_front();
-                if (msg.op == OpCode::LEAVE_OP && !is_local) {
-                    room.leave(shared_from_this());
-                    shutdown();
-                }
+                continue;
+            }
+            buffer.clear();
+            std::size_t bytes { 0 };
+            auto end { write_msgs.begin() };
+            for (; end != write_msgs.end() && end->op != OpCode::LEAVE_OP; end++) {
+                append(*end);
+                bytes += queued_size(*end);
+            }
+            auto leaving { end != write_msgs.end() };
+            while (!bulk_msgs.empty() && (leaving || bucket.available())) {
+                auto size { buffer.size() };
+                append(bulk_msgs.front());
+                bucket.take(buffer.size() - size);
+                bytes += queued_size(bulk_msgs.front());
+                bulk_msgs.pop_front();
+            }
+            auto before_leave { buffer.size() };
+            if (leaving) {
+                append(*end);
+                bytes += queued_size(*end++);
+            }
+            buffers.assign({ asio::buffer(buffer.data(), before_leave) });
+            frames.assign(shared_msgs.begin(), shared_msgs.end());
+            shared_msgs.clear();
+            for (auto& frame : frames) {
+                auto& data { binary ? frame->binary : frame->json };
+                buffers.push_back(asio::buffer(data));
+                bytes += frame->json.size();
+            }
+            buffers.push_back(asio::buffer(buffer.data() + before_leave, buffer.size() - before_leave));
+            queue_metrics.bytes -= bytes;
+            report_queued_bytes();
+            write_msgs.erase(write_msgs.begin(), end);
+            queue_metrics.messages = write_msgs.size() + bulk_msgs.size();
+            check_recovered();
+            auto written { co_await asio::async_write(socket, buffers, use_awaitable) };
+            metrics.out.record(written, std::exchange(appended, 0) + frames.size());
+            frames.clear();
+            if (buffer.capacity() > max_kept_capacity)
+                buffer = {};
+            if (leaving && !is_local) {
+                post_to_room([self = shared_from_this()](const std::shared_ptr<Room>& room) { room->leave(self); });
+                shutdown();
             }
         }
     } catch (std::exception& e) {
@@ -586,28 +1395,257 @@ awaitable<void> Participant::writer()
             stop();
     }
 }
+void Participant::enqueue(Message msg)
+{
+    if (!socket.is_open())
+        return;
+    StageTimer timing { ServerMetrics::Stage::ENQUEUE, msg.op };
+    queue_metrics.bytes += queued_size(msg);
+    // the local participant keeps a single lane: UI states must stay in order with the
+    // messages around them
+    (!is_local && is_bulk(msg.op) ? bulk_msgs : write_msgs).push_back(std::move(msg));
+    update_queue_metrics();
+}
+// the frame is shared with the other spectators; what it pins counts against the limits
+void Participant::enqueue(SharedFrame_ptr frame)
+{
+    if (!socket.is_open())
+        return;
+    StageTimer timing { ServerMetrics::Stage::ENQUEUE, frame->op };
+    queue_metrics.bytes += frame->json.size();
+    shared_msgs.push_back(std::move(frame));
+    update_queue_metrics();
+}
+void Participant::update_queue_metrics()
+{
+    auto messages { write_msgs.size() + bulk_msgs.size() + shared_msgs.size() };
+    if (messages > shed_messages || queue_metrics.bytes > shed_bytes) {
+        shed_load();
+        messages = write_msgs.size() + bulk_msgs.size() + shared_msgs.size();
+    }
+    queue_metrics.messages = messages;
+    queue_metrics.peak_messages = std::max<std::size_t>(queue_metrics.peak_messages, messages);
+    queue_metrics.peak_bytes = std::max<std::size_t>(queue_metrics.peak_bytes, queue_metrics.bytes);
+    report_queued_bytes();
+    timer.cancel_one();
+}
+void Participant::report_queued_bytes()
+{
+    auto bytes { queue_metrics.bytes.load() };
+    metrics.queued_bytes.add(std::int64_t(bytes) - std::int64_t(std::exchange(reported_bytes, bytes)));
+}
+// Applies SLOW_CONSUMER_POLICY to write queues over their limits. The local participant is
+// never disconnected, DISCONNECT drops its bulk messages instead.
+void Participant::shed_load()
+{
+    auto policy { SLOW_CONSUMER_POLICY };
+    if (is_local && policy == SlowConsumerPolicy::DISCONNECT)
+        policy = SlowConsumerPolicy::PRIORITY_ONLY;
+    std::size_t dropped { 0 };
+    auto resync { false };
+    if (policy != SlowConsumerPolicy::DISCONNECT) {
+        // newest first, so that the latest UI state and analysis result are kept; deltas
+        // cannot be merged, and only those older than a kept snapshot are not missed
+        auto ui_state { false }, analysis { false };
+        for (auto lane : { &write_msgs, &bulk_msgs }) {
+            std::deque<Message> kept;
+            for (auto& msg : *lane | std::views::reverse) {
+                auto drop { policy == SlowConsumerPolicy::PRIORITY_ONLY && is_bulk(msg.op) };
+                auto delta { msg.op == OpCode::UI_STATE_DELTA_OP && !msg.data2.starts_with(R"({"snapshot":)") };
+                if (msg.op == OpCode::UPDATE_UI_STATE_OP || (msg.op == OpCode::UI_STATE_DELTA_OP && !delta))
+                    drop = drop || std::exchange(ui_state, true);
+                else if (msg.op == OpCode::ANALYSIS_RESULT_OP)
+                    drop = drop || std::exchange(analysis, true);
+                else if (delta)
+                    drop = true;
+                if (drop) {
+                    resync = resync || (delta && !ui_state);
+                    queue_metrics.bytes -= queued_size(msg);
+                    dropped++;
+                } else {
+                    kept.push_front(std::move(msg));
+                }
+            }
+            *lane = std::move(kept);
+        }
+        // a spectator needs nothing before the newest full UI state
+        auto snapshot { std::ranges::find(shared_msgs | std::views::reverse, OpCode::UPDATE_UI_STATE_OP, &SharedFrame::op) };
+        if (snapshot != shared_msgs.rend()) {
+            auto stale { shared_msgs.rend() - snapshot - 1 };
+            for (auto& frame : shared_msgs | std::views::take(stale))
+                queue_metrics.bytes -= frame->json.size();
+            shared_msgs.erase(shared_msgs.begin(), shared_msgs.begin() + stale);
+            dropped += stale;
+        }
+        queue_metrics.dropped += dropped;
+    }
+    auto messages { write_msgs.size() + bulk_msgs.size() + shared_msgs.size() };
+    if (!std::exchange(overloaded, true))
+        logger->warn("shed_load: {} queued {} messages / {} bytes, dropped {}",
+            ::to_string(endpoint()), messages, queue_metrics.bytes.load(), dropped);
+    else
+        LOG_DEBUG("shed_load: {} queued {} messages / {} bytes, dropped {}",
+            ::to_string(endpoint()), messages, queue_metrics.bytes.load(), dropped);
+    // what is left cannot be dropped: go through it again only once it has doubled, rather
+    // than on every message
+    shed_messages = std::max(MAX_QUEUED_MESSAGES, 2 * messages);
+    shed_bytes = std::max(MAX_QUEUED_BYTES, 2 * queue_metrics.bytes);
+    // a client missing deltas needs a snapshot, which then follows the messages kept
+    if (resync) {
+        post_to_room([](const std::shared_ptr<Room>& room) { room->deliver_ui_state(true); });
+    }
+    if (!is_local && (messages > MAX_QUEUED_MESSAGES || queue_metrics.bytes > MAX_QUEUED_BYTES)) {
+        logger->error("shed_load: disconnect slow consumer {}", ::to_string(endpoint()));
+        write_msgs.clear();
+        bulk_msgs.clear();
+        shared_msgs.clear();
+        queue_metrics.bytes = 0;
+        stop();
+    }
+}
+// ends an overload once the writer has drained the queues to half their limits
+void Participant::check_recovered()
+{
+    if (!overloaded || queue_metrics.messages > MAX_QUEUED_MESSAGES / 2 || queue_metrics.bytes > MAX_QUEUED_BYTES / 2)
+        return;
+    overloaded = false;
+    shed_messages = MAX_QUEUED_MESSAGES;
+    shed_bytes = MAX_QUEUED_BYTES;
+    logger->info("shed_load: {} recovered, {} dropped so far", ::to_string(endpoint()), queue_metrics.dropped.load());
+}
 void Participant::start()
 {
-    room.join(shared_from_this());
+    post_to_room([self = shared_from_this()](const std::shared_ptr<Room>& room) { room->join(self); });
 
     co_spawn(
         socket.get_executor(), [self = shared_from_this()] { return self->reader(); }, detached);
     co_spawn(
         socket.get_executor(), [self = shared_from_this()] { return self->writer(); }, detached);
+    if (!is_local && IDLE_TIMEOUT > 0s) {
+        last_read = TimingWheel::clock::now().time_since_epoch().count();
+        idle_timer.emplace(current_room()->registry.timers, socket.get_executor());
+        asio::post(socket.get_executor(), [self = shared_from_this()] { self->watch_idle(); });
+    }
+}
+// re-armed for the rest of IDLE_TIMEOUT after the last read, rather than on every read
+void Participant::watch_idle()
+{
+    if (stopping)
+        return;
+    auto idle { TimingWheel::clock::now() - TimingWheel::clock::time_point { TimingWheel::clock::duration { last_read.load(std::memory_order_relaxed) } } };
+    if (idle >= IDLE_TIMEOUT) {
+        logger->info("watch_idle: disconnect {}, idle for {}s", ::to_string(endpoint()), std::chrono::duration_cast<seconds>(idle).count());
+        stop();
+        return;
+    }
+    idle_timer->expires_after(IDLE_TIMEOUT - idle, [participant = weak_from_this()] {
+        if (auto self { participant.lock() })
+            self->watch_idle();
+    });
 }
 void Participant::stop()
 {
-    logger->debug("stop: {} leave room", ::to_string(endpoint()));
-    room.leave(shared_from_this());
-    logger->debug("stop: close socket");
-    socket.close();
-    logger->debug("stop: cancel timer");
-    timer.cancel();
+    // nothing to do once the participant is being destroyed, or a second time: the socket
+    // may be closed already and endpoint() would throw
+    auto self { weak_from_this().lock() };
+    if (!self || stopping.exchange(true))
+        return;
+    LOG_DEBUG("stop: {} leave room", ::to_string(endpoint()));
+    logger->info("stop: {} write queue peak {} messages / {} bytes, {} dropped", ::to_string(endpoint()),
+        queue_metrics.peak_messages.load(), queue_metrics.peak_bytes.load(), queue_metrics.dropped.load());
+    post_to_room([self](const std::shared_ptr<Room>& room) { room->leave(self); });
+    asio::post(socket.get_executor(), [self] {
+        LOG_DEBUG("stop: close socket");
+        self->socket.close();
+        LOG_DEBUG("stop: cancel timer");
+        self->timer.cancel();
+        if (self->idle_timer)
+            self->idle_timer->cancel();
+    });
+}
+
+void Participant::create_room(string_view data1, string_view)
+{
+    // data1 = room name, empty for a generated one
+    if (!is_local)
+        throw std::logic_error { "Remote participant should not create room" };
+    if (!data1.empty() && room->registry.find(data1)) {
+        deliver({ OpCode::ROOM_RESULT_OP, "failed", "Room already exists" });
+        return;
+    }
+    enter_room(room->registry.create(string { data1 }));
+}
+void Participant::join_room(string_view data1, string_view)
+{
+    // data1 = room name, empty for the lobby
+    auto target { room->registry.find(data1) };
+    if (!target) {
+        deliver({ OpCode::ROOM_RESULT_OP, "failed", "Room not found" });
+        return;
+    }
+    if (is_local && target != room && target->has_local_participant()) {
+        deliver({ OpCode::ROOM_RESULT_OP, "failed", "Room already has a local participant" });
+        return;
+    }
+    enter_room(target);
+}
+void Participant::spectate(string_view data1, string_view)
+{
+    // data1 = room name
+    if (is_local)
+        throw std::logic_error { "Local participant should not spectate" };
+    auto target { room->registry.find(data1) };
+    if (!target) {
+        deliver({ OpCode::ROOM_RESULT_OP, "failed", "Room not found" });
+        return;
+    }
+    enter_room(target, true);
+}
+void Participant::enter_room(std::shared_ptr<Room> target, bool as_spectator)
+{
+    auto self { shared_from_this() };
+    if (target != room || as_spectator != spectator) {
+        if (room->contest.status == Contest::Status::ON_GOING && (is_local || player.participant == self)) {
+            deliver({ OpCode::ROOM_RESULT_OP, "failed", "Contest on going" });
+            return;
+        }
+        room->leave(self);
+        std::lock_guard guard { room_mutex };
+        room = target;
+    }
+    // runs on the strand of the previous room
+    asio::post(target->strand, [target, self, as_spectator] {
+        // released after find() returned it: back to the lobby
+        if (!target->registry.contains(*target)) {
+            auto lobby { target->registry.lobby() };
+            {
+                std::lock_guard guard { self->room_mutex };
+                self->room = lobby;
+            }
+            self->deliver({ OpCode::ROOM_RESULT_OP, "failed", "Room not found" });
+            asio::post(lobby->strand, [lobby, self] {
+                lobby->join(self);
+                if (self->is_local)
+                    lobby->deliver_ui_state(true);
+            });
+            return;
+        }
+        if (as_spectator) {
+            // the result goes out before the state that follows it
+            self->deliver({ OpCode::ROOM_RESULT_OP, "success", target->name });
+            target->spectate(self);
+            return;
+        }
+        target->join(self);
+        self->deliver({ OpCode::ROOM_RESULT_OP, "success", target->name });
+        if (self->is_local)
+            target->deliver_ui_state(true);
+    });
 }
 
 void Participant::process_game_over()
 {
-    auto& contest { room.contest };
+    auto& contest { room->contest };
     auto winner { contest.players.at(contest.result.winner) };
     auto loser { contest.players.at(-winner.role) };
 
@@ -624,51 +1662,54 @@ void Participant::process_game_over()
     }
 }
 
-void start_session(asio::io_context& io_context, Room& room, asio::error_code& ec, tcp::endpoint endpoint);
+void start_session(asio::io_context& io_context, std::shared_ptr<Room> room, asio::error_code& ec, tcp::endpoint endpoint);
 
 class RemoteSession : public Participant {
+    tcp::endpoint remote; // still known once the socket is closed
+
 public:
-    RemoteSession(tcp::socket socket, Room& room, string name)
+    RemoteSession(tcp::socket socket, std::shared_ptr<Room> room, string name)
         : Participant(std::move(socket), room, ::to_string(socket.remote_endpoint()))
+        , remote(this->socket.remote_endpoint())
     {
-        logger->debug("RemoteSession: {}", ::to_string(*this));
+        LOG_DEBUG("RemoteSession: {}", ::to_string(*this));
         this->is_local = false;
     }
 
     ~RemoteSession()
     {
-        logger->debug("~RemoteSession: {}", ::to_string(*this));
+        LOG_DEBUG("~RemoteSession: {}", ::to_string(*this));
         deliver({ OpCode::LEAVE_OP });
         stop();
     }
 
     tcp::endpoint endpoint() const override
     {
-        return socket.remote_endpoint();
+        return remote;
     }
 
     void ready(string_view data1, string_view data2) override
     {
-        fmt::print("ready: is_local = {}, data1 = {}, data2 = {}\n", this->is_local, data1, data2);
+        LOG_DEBUG("ready: is_local = {}, data1 = {}, data2 = {}", this->is_local, data1, data2);
 
-        auto& my_request { this->room.my_request };
-        auto& received_requests { this->room.received_requests };
-        auto& contest { this->room.contest };
+        auto& my_request { this->room->my_request };
+        auto& received_requests { this->room->received_requests };
+        auto& contest { this->room->contest };
 
         if (contest.status == Contest::Status::GAME_OVER) {
             contest = Contest {};
-            contest.duration = TIMEOUT;
+            contest.duration = TIMEOUT.load(std::memory_order_relaxed);
         }
 
         // TODO: warn if invalid name
-        string_view name { room.receive_participant_name(shared_from_this(), data1) };
+        string name { room->receive_participant_name(shared_from_this(), data1) };
         Role role { data2 };
 
         if (my_request == shared_from_this()) {
-            auto local_participant { room.find_local_participant() };
-            room.deliver_to_local({ OpCode::RECEIVE_REQUEST_RESULT_OP, "accepted", name });
+            auto local_participant { room->find_local_participant() };
+            room->deliver_to_local({ OpCode::RECEIVE_REQUEST_RESULT_OP, "accepted", name });
             // contest accepted, enroll players
-            logger->debug("contest accepted, enroll players");
+            LOG_DEBUG("contest accepted, enroll players");
             if (role == Role::NONE) {
                 role = -local_participant->player.role;
             }
@@ -676,34 +1717,33 @@ public:
                 throw std::logic_error("role not match");
             }
             this->player = Player { shared_from_this(), name, role, PlayerType::REMOTE_HUMAN_PLAYER };
-            logger->debug("role = {}, local_participant->player.role = {}", int(role), int(local_participant->player.role));
+            LOG_DEBUG("role = {}, local_participant->player.role = {}", int(role), int(local_participant->player.role));
             contest = Contest { PlayerList { this->player, local_participant->player } };
-            contest.duration = TIMEOUT;
+            contest.duration = TIMEOUT.load(std::memory_order_relaxed);
             contest.local_role = local_participant->player.role;
             // TODO: catch exceptions when enrolling players
             my_request = nullptr;
-            room.reject_all_received_requests(this->name);
-            room.check_bot(this->player);
+            room->reject_all_received_requests(this->name);
+            room->check_bot(this->player);
         } else {
             if (contest.status == Contest::Status::ON_GOING) {
-                deliver({ OpCode::REJECT_OP, room.find_local_participant()->name, "Contest already started" });
+                deliver({ OpCode::REJECT_OP, room->find_local_participant()->name, "Contest already started" });
                 return;
             }
             this->player = Player { shared_from_this(), name, role, PlayerType::REMOTE_HUMAN_PLAYER };
-            if (received_requests.empty()) {
-                room.deliver_to_local({ OpCode::RECEIVE_REQUEST_OP, this->name, this->player.role.map("b", "w", "") });
-            }
             received_requests.push_back(shared_from_this());
+            if (received_requests.size() == 1)
+                room->show_received_request();
         }
     }
     void reject(string_view data1, string_view) override
     {
-        auto& contest { room.contest };
-        auto& my_request { room.my_request };
+        auto& contest { room->contest };
+        auto& my_request { room->my_request };
 
-        auto name { room.receive_participant_name(shared_from_this(), data1) };
+        auto name { room->receive_participant_name(shared_from_this(), data1) };
         if (my_request == shared_from_this()) {
-            room.deliver_to_local({ OpCode::RECEIVE_REQUEST_RESULT_OP, "rejected", name });
+            room->deliver_to_local({ OpCode::RECEIVE_REQUEST_RESULT_OP, "rejected", name });
             my_request = nullptr;
             contest.reject();
         }
@@ -713,7 +1753,7 @@ public:
     {
         // data1: role(local) / username(online)
         // TODO: data2(greeting)
-        auto& contest { room.contest };
+        auto& contest { room->contest };
         Player player { this->player }, opponent;
         try {
             opponent = contest.players.at(-player.role);
@@ -725,6 +1765,7 @@ public:
 
         try {
             contest.concede(player);
+            metrics.games.add();
         } catch (Contest::StatusError& e) {
             logger->error("Ignore concede: {}, Contest status is {}", e.what(), std::to_underlying(contest.status));
             return;
@@ -732,15 +1773,14 @@ public:
             logger->error("Concede: In {}'s turn, {}", contest.current.role.to_string(), e.what());
             return;
         }
-        room.timer_cancelled = true;
-        room.timer.cancel();
+        room->turn_timer.cancel();
         if (contest.status == Contest::Status::GAME_OVER)
             process_game_over();
     }
     void gg_end(OpCode op)
     // confirmation from the loser
     {
-        auto& contest { room.contest };
+        auto& contest { room->contest };
         if (contest.result.confirmed)
             return;
         auto player { this->player };
@@ -755,7 +1795,7 @@ public:
             auto result_valid { claimed_win_type == contest.result.win_type };
             // Use lenient validation for timeout
             if (claimed_win_type == Contest::WinType::TIMEOUT && !result_valid) {
-                auto remain_time { std::chrono::duration_cast<milliseconds>(timer.expiry() - std::chrono::steady_clock::now()) };
+                auto remain_time { std::chrono::duration_cast<milliseconds>(room->turn_timer.expiry() - std::chrono::steady_clock::now()) };
                 // 270ms is the median human reaction time (reference: https://humanbenchmark.com/tests/reactiontime/statistics)
                 if (remain_time < 270ms) {
                     result_valid = true;
@@ -788,7 +1828,7 @@ public:
     }
     void leave(string_view, string_view) override
     {
-        room.leave(shared_from_this());
+        room->leave(shared_from_this());
         deliver({ OpCode::LEAVE_OP });
         // TODO: contest
     }
@@ -798,7 +1838,7 @@ public:
         if (name.empty()) {
             name = endpoint().address().to_string();
         }
-        room.deliver_to_local({ OpCode::CHAT_RECEIVE_MESSAGE_OP, data1, name });
+        room->deliver_to_local({ OpCode::CHAT_RECEIVE_MESSAGE_OP, data1, name });
     }
 
     void start_local_game(string_view, string_view) override
@@ -873,13 +1913,33 @@ public:
     {
         throw std::logic_error { "Participant should not toggle bot hosting" };
     }
+    void analysis(string_view, string_view) override
+    {
+        throw std::logic_error { "Participant should not request analysis" };
+    }
+    void protocol(string_view data1, string_view data2) override
+    {
+        // data1 = protocol, data2 = offer / accept. Peers that do not know PROTOCOL_OP
+        // ignore the offer and both sides keep sending JSON.
+        if (data1 != wire::PROTOCOL)
+            return;
+        if (data2 == "offer") {
+            deliver({ OpCode::PROTOCOL_OP, wire::PROTOCOL, "accept" });
+        } else if (data2 == "accept") {
+            asio::post(socket.get_executor(), [self = shared_from_this()] { self->binary = true; });
+        }
+    }
+    void ui_state_sync(string_view, string_view) override
+    {
+        throw std::logic_error { "Participant should not request ui_state_sync" };
+    }
 };
 
 class LocalSession : public Participant {
     PlayerList local_players;
 
 public:
-    LocalSession(tcp::socket socket, Room& room, string name)
+    LocalSession(tcp::socket socket, std::shared_ptr<Room> room, string name)
         : Participant(std::move(socket), room, ::to_string(socket.local_endpoint()))
     {
         this->is_local = true;
@@ -907,10 +1967,10 @@ public:
     {
         // data1: role(local) / username(online)
         // TODO: data2(greeting)
-        auto& contest { room.contest };
+        auto& contest { room->contest };
         Player player, opponent;
         try {
-            if (room.is_local_contest()) {
+            if (room->is_local_contest()) {
                 Role role { data1 };
                 player = contest.players.at(role);
             } else {
@@ -923,10 +1983,11 @@ public:
             return;
         }
 
-        room.deliver_to_others({ OpCode::GIVEUP_OP, data1, data2 }, shared_from_this()); // broadcast
+        room->deliver_to_others({ OpCode::GIVEUP_OP, data1, data2 }, shared_from_this()); // broadcast
 
         try {
             contest.concede(player);
+            metrics.games.add();
         } catch (Contest::StatusError& e) {
             logger->error("Ignore concede: {}, Contest status is {}", e.what(), std::to_underlying(contest.status));
             return;
@@ -934,8 +1995,7 @@ public:
             logger->error("Concede: In {}'s turn, {}", contest.current.role.to_string(), e.what());
             return;
         }
-        room.timer_cancelled = true;
-        room.timer.cancel();
+        room->turn_timer.cancel();
         if (contest.status == Contest::Status::GAME_OVER)
             process_game_over();
     }
@@ -953,7 +2013,7 @@ public:
     }
     void leave(string_view, string_view) override
     {
-        room.clear();
+        room->clear();
     }
     void chat(string_view, string_view) override
     {
@@ -963,7 +2023,7 @@ public:
     void start_local_game(string_view data1, string_view data2) override
     {
         // data1 = timeout|type, data2 = size
-        auto& contest { room.contest };
+        auto& contest { room->contest };
         auto tmp = data1 | ranges::views::split("|"sv) | ranges::to<std::vector<std::string>>();
         if (tmp.size() != 2) {
             throw std::logic_error("invalid data1");
@@ -994,7 +2054,7 @@ public:
             contest.players = {};
             return;
         }
-        room.check_bot(contest.players.at(Role::BLACK));
+        room->check_bot(contest.players.at(Role::BLACK));
     }
     // update_ui_state
     // local_game_timeout
@@ -1004,13 +2064,13 @@ public:
         Role role { data2 };
         Player player { local_players.at(role) };
 
-        room.do_move(player, pos, true);
+        room->do_move(player, pos, true);
     }
     void connect_to_remote(string_view data1, string_view data2) override
     {
         asio::error_code ec;
         tcp::endpoint endpoint { asio::ip::make_address(data1), integer_cast<asio::ip::port_type>(data2) };
-        start_session(room.io_context, room, ec, endpoint);
+        start_session(room->io_context, room, ec, endpoint);
         if (ec) {
             logger->error("start_session failed: {}", ec.message());
             deliver({ OpCode::CONNECT_RESULT_OP, "failed", "connect failed" });
@@ -1023,20 +2083,17 @@ public:
 
     void chat_send_message(string_view data1, string_view data2) override
     {
-        auto success { false };
-        for (auto participant : room.participants) {
-            if (!this->name.empty() && this->name == data2) {
-                participant->deliver({ OpCode::CHAT_OP, data1 });
-                success = true;
-            } else if (participant->name.empty() && participant->endpoint().address().to_string() == data2) {
-                participant->deliver({ OpCode::CHAT_OP, data1 });
-                success = true;
-            }
+        // data2 is the name of the receiver, or the address of unnamed ones
+        if (auto participant { room->participants.find_by_name(data2) }) {
+            participant->deliver({ OpCode::CHAT_OP, data1 });
+            return;
         }
+        for (auto& participant : room->participants.find_unnamed(data2))
+            participant->deliver({ OpCode::CHAT_OP, data1 });
     }
     void chat_send_broadcast_message(string_view data1, string_view) override
     {
-        room.deliver_to_others({ OpCode::CHAT_OP, data1 }, shared_from_this());
+        room->deliver_to_others({ OpCode::CHAT_OP, data1 }, shared_from_this());
     }
     // chat_receive_message
     void chat_username_update(string_view, string_view) override
@@ -1045,22 +2102,19 @@ public:
 
     void sync_online_settings(string_view data1, string_view data2)
     {
-        room.receive_participant_name(shared_from_this(), data1);
+        room->receive_participant_name(shared_from_this(), data1);
         std::chrono::seconds duration { stoi(data2) };
-        TIMEOUT = duration;
-        // room.contest.duration = TIMEOUT;
+        TIMEOUT.store(duration, std::memory_order_relaxed);
     }
-    void send_request(string_view role_str, auto&& predicate)
+    void send_request(string_view role_str, Participant_ptr participant)
     {
-        auto& participants { this->room.participants };
-        auto& my_request { this->room.my_request };
+        auto& my_request { this->room->my_request };
         Role role { role_str };
-        auto participant { std::ranges::find_if(participants, predicate) };
-        if (participant == participants.end()) {
+        if (!participant) {
             logger->error("send_request failed: {}, participant not found", ::to_string(shared_from_this()));
             return;
         }
-        my_request = *participant;
+        room->send_request(participant);
         my_request->deliver({ OpCode::READY_OP, name, role_str });
         this->player = Player { shared_from_this(), name, role, PlayerType::LOCAL_HUMAN_PLAYER };
     }
@@ -1071,12 +2125,12 @@ public:
         auto port { data1.substr(data1.find(':') + 1) };
         tcp::endpoint ep { asio::ip::make_address(host), integer_cast<asio::ip::port_type>(port) };
 
-        send_request(data2, [&](auto p) { return p->endpoint() == ep; });
+        send_request(data2, room->participants.find_by_endpoint(ep));
     }
     void send_request_by_username(string_view data1, string_view data2) override
     {
         // data1 is username, data2 is role
-        send_request(data2, [&](auto p) { return p->name == data1; });
+        send_request(data2, room->participants.find_by_name(data1));
     }
     void receive_request(string_view, string_view) override
     {
@@ -1085,41 +2139,41 @@ public:
 
     void accept_request(string_view, string_view) override
     {
-        auto& received_requests { this->room.received_requests };
+        auto& received_requests { this->room->received_requests };
         if (received_requests.empty())
             throw std::logic_error { "received_requests.empty()" };
         auto participant { received_requests.front() };
         received_requests.pop_front();
-        room.reject_all_received_requests(this->name);
+        room->reject_all_received_requests(this->name);
 
         this->player = Player { shared_from_this(), this->name, -participant->player.role, PlayerType::LOCAL_HUMAN_PLAYER };
         participant->deliver({ OpCode::READY_OP, this->name });
         // logger->info("accept_request: {} {}", ::to_string(request.sender->player), ::to_string(request.receiver->player));
-        room.contest = Contest { { this->player, participant->player } };
-        room.contest.duration = TIMEOUT;
+        room->contest = Contest { { this->player, participant->player } };
+        room->contest.duration = TIMEOUT.load(std::memory_order_relaxed);
 
-        logger->debug("contest accepted, enroll players");
-        logger->debug("role = {}, my_request->player.role = {}", int(this->player.role), int(participant->player.role));
-        room.contest.local_role = participant->is_local ? participant->player.role : -participant->player.role;
+        LOG_DEBUG("contest accepted, enroll players");
+        LOG_DEBUG("role = {}, my_request->player.role = {}", int(this->player.role), int(participant->player.role));
+        room->contest.local_role = participant->is_local ? participant->player.role : -participant->player.role;
     }
     void reject_request(string_view, string_view) override
     {
-        auto& received_requests { this->room.received_requests };
+        auto& received_requests { this->room->received_requests };
         if (received_requests.empty())
             throw std::runtime_error { "received_requests.empty()" };
         auto participant { received_requests.front() };
         received_requests.pop_front();
         participant->deliver({ OpCode::REJECT_OP, this->name });
-        if (!received_requests.empty()) {
-            auto next_participant { received_requests.front() };
-            next_participant->deliver({ OpCode::RECEIVE_REQUEST_OP, next_participant->name, next_participant->player.role.map("b", "w", "") });
-        }
+        if (received_requests.empty())
+            room->received_request_timer.cancel();
+        else
+            room->show_received_request();
     }
     // receive_request_result
 
     void replay_start_move(string_view data1, string_view data2)
     {
-        auto& contest { this->room.contest };
+        auto& contest { this->room->contest };
         // data1: current moves
         // data2: board size
         if (contest.status == Contest::Status::ON_GOING) {
@@ -1131,7 +2185,7 @@ public:
         Player player1 { shared_from_this(), "BLACK", Role::BLACK, PlayerType::LOCAL_HUMAN_PLAYER },
             player2 { shared_from_this(), "WHITE", Role::WHITE, PlayerType::LOCAL_HUMAN_PLAYER };
         contest = Contest { { player1, player2 } };
-        contest.duration = TIMEOUT;
+        contest.duration = TIMEOUT.load(std::memory_order_relaxed);
         contest.local_role = Role::BLACK;
         contest.is_replaying = true;
 
@@ -1153,7 +2207,7 @@ public:
     }
     void replay_move(string_view data1, string_view) override
     {
-        auto& contest { room.contest };
+        auto& contest { room->contest };
         Position pos { data1 };
         Role role { contest.moves.size() % 2 == 0 ? Role::BLACK : Role::WHITE };
         auto player { contest.players.at(role) };
@@ -1161,58 +2215,156 @@ public:
     }
     void replay_stop_move(string_view, string_view) override
     {
-        room.contest.clear();
+        room->contest.clear();
     }
 
     void bot_hosting(string_view data1, string_view) override
     {
         Role role { data1 };
-        if (!room.is_local_contest()) {
+        if (!room->is_local_contest()) {
             role = this->player.role;
         }
-        room.toggle_bot_hosting(room.contest.players.at(role), true);
+        room->toggle_bot_hosting(room->contest.players.at(role), true);
+    }
+    void protocol(string_view, string_view) override
+    {
+        throw std::logic_error { "PROTOCOL_OP should not be sent by local" };
+    }
+    void ui_state_sync(string_view data1, string_view) override
+    {
+        // data1 = the version the client has, if any: a client that is up to date gets a delta
+        // from it, or nothing if the state has not changed since
+        LOG_DEBUG("ui_state_sync: client version '{}', room version {}", data1, room->ui_version);
+        ui_delta = true;
+        room->deliver_ui_state(!room->ui_state || data1 != std::to_string(room->ui_version));
+    }
+    void analysis(string_view data1, string_view data2) override
+    {
+        // data1 = top k, 0 stops the analysis; data2 = time limit in ms
+        static constexpr auto max_time_limit { 60s };
+        auto top_k { data1.empty() ? 5 : stoi(string { data1 }) };
+        milliseconds time_limit { data2.empty() ? 10000 : stoi(string { data2 }) };
+        room->start_analysis(top_k, std::clamp<milliseconds>(time_limit, 0ms, max_time_limit));
     }
 };
 
-void start_session(asio::io_context& io_context, Room& room, asio::error_code& ec, tcp::endpoint endpoint)
+void start_session(asio::io_context& io_context, std::shared_ptr<Room> room, asio::error_code& ec, tcp::endpoint endpoint)
 {
-    tcp::socket socket { io_context };
+    tcp::socket socket { asio::make_strand(io_context) };
     socket.connect(endpoint, ec);
-    if (!ec)
-        std::make_shared<RemoteSession>(std::move(socket), room, "")->start();
+    if (!ec) {
+        auto session { std::make_shared<RemoteSession>(std::move(socket), room, "") };
+        session->start();
+        session->deliver({ OpCode::PROTOCOL_OP, wire::PROTOCOL, "offer" });
+    }
 }
 
 template <bool is_local>
-awaitable<void> listener(tcp::acceptor acceptor, Room& room)
+awaitable<void> listener(tcp::acceptor acceptor, RoomRegistry& registry)
 {
     for (;;) {
+        // each connection gets its own strand
+        tcp::socket socket { asio::make_strand(acceptor.get_executor()) };
+        co_await acceptor.async_accept(socket, use_awaitable);
         if constexpr (is_local)
-            std::make_shared<LocalSession>(co_await acceptor.async_accept(use_awaitable), room, "")->start();
+            std::make_shared<LocalSession>(std::move(socket), registry.lobby(), "")->start();
         else
-            std::make_shared<RemoteSession>(co_await acceptor.async_accept(use_awaitable), room, "")->start();
+            std::make_shared<RemoteSession>(std::move(socket), registry.lobby(), "")->start();
         logger->info("new connection to {}", ::to_string(acceptor.local_endpoint()));
     }
 }
 
-_EXPORT void launch_server(std::vector<asio::ip::port_type> ports)
+// One HTTP/1.0 style exchange per connection: GET /metrics gets the metrics, anything else
+// a 404. Only the counters are read, so a scrape never waits for a room or a participant.
+awaitable<void> serve_metrics(tcp::socket socket)
+{
+    try {
+        string request;
+        co_await asio::async_read_until(socket, asio::dynamic_buffer(request, 8192), "\r\n\r\n", use_awaitable);
+        auto found { request.starts_with("GET /metrics ") || request.starts_with("GET /metrics?") };
+        auto body { found ? metrics.to_prometheus() : string { "Not Found\n" } };
+        auto response { fmt::format("HTTP/1.1 {}\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                    "Content-Length: {}\r\nConnection: close\r\n\r\n{}",
+            found ? "200 OK" : "404 Not Found", body.size(), body) };
+        co_await asio::async_write(socket, asio::buffer(response), use_awaitable);
+        asio::error_code ec;
+        socket.shutdown(tcp::socket::shutdown_send, ec);
+    } catch (std::exception& e) {
+        LOG_DEBUG("serve_metrics: {}", e.what());
+    }
+}
+awaitable<void> metrics_listener(tcp::acceptor acceptor)
+{
+    for (;;) {
+        tcp::socket socket { asio::make_strand(acceptor.get_executor()) };
+        co_await acceptor.async_accept(socket, use_awaitable);
+        auto executor { socket.get_executor() };
+        co_spawn(executor, serve_metrics(std::move(socket)), detached);
+    }
+}
+
+// how late a timer on the event loop runs, every interval
+awaitable<void> probe_loop_lag(milliseconds interval)
+{
+    asio::steady_timer timer { co_await asio::this_coro::executor };
+    for (;;) {
+        timer.expires_after(interval);
+        co_await timer.async_wait(use_awaitable);
+        metrics.loop_lag.store(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - timer.expiry()).count(),
+            std::memory_order_relaxed);
+    }
+}
+
+_EXPORT void launch_server(std::vector<asio::ip::port_type> ports, int threads = 1)
 {
     try {
-        asio::io_context io_context(1);
-        Room room { io_context };
+        asio::io_context io_context(threads);
+        RoomRegistry registry { io_context };
 
         tcp::endpoint local { tcp::v4(), ports[0] };
-        co_spawn(io_context, listener<true>(tcp::acceptor(io_context, local), room), detached);
+        co_spawn(io_context, listener<true>(tcp::acceptor(io_context, local), registry), detached);
         logger->info("Serving on {}:{}", local.address().to_string(), local.port());
         for (auto port : ports | std::views::drop(1)) {
             tcp::endpoint ep { tcp::v4(), port };
-            co_spawn(io_context, listener<false>(tcp::acceptor(io_context, ep), room), detached);
+            co_spawn(io_context, listener<false>(tcp::acceptor(io_context, ep), registry), detached);
             logger->info("Serving on {}:{}", ep.address().to_string(), ep.port());
         }
+        if (METRICS_PORT) {
+            tcp::endpoint ep { asio::ip::address_v4::loopback(), METRICS_PORT };
+            co_spawn(io_context, metrics_listener(tcp::acceptor(io_context, ep)), detached);
+            co_spawn(io_context, probe_loop_lag(100ms), detached);
+            logger->info("Serving metrics on {}:{}", ep.address().to_string(), ep.port());
+        }
 
         asio::signal_set signals(io_context, SIGINT, SIGTERM);
         signals.async_wait([&](auto, auto) { io_context.stop(); });
-
-        io_context.run();
+#ifdef SIGUSR1
+        // kill -USR1 logs what METRICS_OP would return
+        asio::signal_set dump_signals(io_context, SIGUSR1);
+        std::function<void()> wait_for_dump = [&] {
+            dump_signals.async_wait([&](const asio::error_code& ec, int) {
+                if (ec)
+                    return;
+                logger->info("metrics: {}", metrics.to_json().dump());
+                wait_for_dump();
+            });
+        };
+        wait_for_dump();
+#endif
+
+        auto run = [&] {
+            try {
+                io_context.run();
+            } catch (std::exception& e) {
+                logger->error("Exception: {}", e.what());
+                io_context.stop();
+            }
+        };
+        logger->info("Running on {} threads", threads);
+        std::vector<std::jthread> workers;
+        for (int i = 1; i < threads; i++)
+            workers.emplace_back(run);
+        run();
     } catch (std::exception& e) {
         logger->error("Exception: {}", e.what());
     }
@@ -0,0 +1,247 @@
+// Plays many concurrent games against a running server to find where it saturates. Every
+// game is a session on the UI port that creates a room of its own and a session on the peer
+// port that joins it and asks for the game; they then play random (or bot) moves until one
+// side has none left, and start over. The latency of a move is the time from writing its
+// MOVE_OP to the opponent reading it.
+//
+//   nogo-loadgen <host> <ui port> <peer port> [<games>] [<seconds>] [<think ms>] [random|bot]
+//
+// It exits with 2 if any game failed or no move was played.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <asio.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/use_awaitable.hpp>
+
+#include <fmt/format.h>
+
+#include "../bot.hpp"
+#include "../message.hpp"
+#include "../rule.hpp"
+#include "../utility.hpp"
+
+using asio::awaitable;
+using asio::co_spawn;
+using asio::detached;
+using asio::use_awaitable;
+using asio::ip::tcp;
+using namespace std::chrono_literals;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+struct Options {
+    string host;
+    asio::ip::port_type ui_port, peer_port;
+    int games { 100 };
+    seconds duration { 60 };
+    milliseconds think { 0 };
+    bool bot {};
+};
+
+struct Results {
+    std::mutex mutex;
+    std::vector<std::uint32_t> latencies; // microseconds
+    std::atomic<std::uint64_t> moves, games, errors;
+
+    void merge(const std::vector<std::uint32_t>& game)
+    {
+        std::lock_guard guard { mutex };
+        latencies.insert(latencies.end(), game.begin(), game.end());
+    }
+    void report(seconds elapsed)
+    {
+        std::lock_guard guard { mutex };
+        std::ranges::sort(latencies);
+        auto percentile = [&](double q) {
+            return latencies.empty() ? 0.0 : latencies[std::min<std::size_t>(latencies.size() - 1, q * latencies.size())] / 1000.0;
+        };
+        fmt::print("{} games, {} moves ({:.0f}/s), {} errors\n", games.load(), moves.load(),
+            moves / std::max<double>(1, elapsed.count()), errors.load());
+        fmt::print("MOVE_OP latency: p50 {:.3f}ms, p99 {:.3f}ms, p999 {:.3f}ms, max {:.3f}ms\n",
+            percentile(0.5), percentile(0.99), percentile(0.999), percentile(1));
+    }
+};
+
+class Connection {
+    tcp::socket socket;
+    string buffer;
+
+public:
+    explicit Connection(tcp::socket socket)
+        : socket(std::move(socket))
+    {
+    }
+
+    awaitable<void> send(const Message& msg)
+    {
+        string line;
+        msg.append_to(line);
+        line += '\n';
+        co_await asio::async_write(socket, asio::buffer(line), use_awaitable);
+    }
+    awaitable<Message> receive()
+    {
+        auto size { co_await asio::async_read_until(socket, asio::dynamic_buffer(buffer), '\n', use_awaitable) };
+        Message msg { string_view { buffer }.substr(0, size - 1) };
+        buffer.erase(0, size);
+        co_return msg;
+    }
+    // skips everything else, such as the UI states of the local session
+    awaitable<Message> receive(OpCode op)
+    {
+        for (;;) {
+            auto msg { co_await receive() };
+            if (msg.op == op)
+                co_return msg;
+        }
+    }
+};
+
+auto choose_move(const State& state, bool bot, std::mt19937& random) -> std::optional<Position>
+{
+    if (bot) {
+        MCTSOptions options { .C = 1.5, .policy = LeafPolicy::PLAYOUT, .time_limit = 1h, .iterations = 100 };
+        auto root { mcts_search(state, options) };
+        if (root->children.empty())
+            return std::nullopt;
+        return (*std::ranges::max_element(root->children, std::less {}, [](auto& child) { return child->visit; }))->state.last_move;
+    }
+    auto actions { state.available_actions() | ranges::to<std::vector>() };
+    if (actions.empty())
+        return std::nullopt;
+    return actions[std::uniform_int_distribution<std::size_t> { 0, actions.size() - 1 }(random)];
+}
+
+awaitable<void> play(const Options& options, Results& results, int id, steady_clock::time_point deadline)
+{
+    auto executor { co_await asio::this_coro::executor };
+    tcp::resolver resolver { executor };
+    asio::steady_timer timer { executor };
+    std::mt19937 random(id);
+    auto failed { false };
+    auto connect = [&](asio::ip::port_type port) -> awaitable<Connection> {
+        tcp::socket socket { executor };
+        co_await asio::async_connect(socket, co_await resolver.async_resolve(options.host, std::to_string(port), use_awaitable), use_awaitable);
+        socket.set_option(tcp::no_delay { true });
+        co_return Connection { std::move(socket) };
+    };
+
+    for (auto round { 0 }; steady_clock::now() < deadline; round++) {
+        std::vector<std::uint32_t> latencies;
+        try {
+            auto room { fmt::format("load-{}-{}", id, round) };
+            auto local { co_await connect(options.ui_port) };
+            co_await local.send({ OpCode::SYNC_ONLINE_SETTINGS_OP, fmt::format("Local{}", id), "30" });
+            co_await local.send({ OpCode::CREATE_ROOM_OP, room });
+            if (auto result { co_await local.receive(OpCode::ROOM_RESULT_OP) }; result.data1 != "success")
+                throw std::runtime_error { "create room: " + result.data2 };
+            auto remote { co_await connect(options.peer_port) };
+            co_await remote.send({ OpCode::JOIN_ROOM_OP, room });
+            if (auto result { co_await remote.receive(OpCode::ROOM_RESULT_OP) }; result.data1 != "success")
+                throw std::runtime_error { "join room: " + result.data2 };
+            co_await remote.send({ OpCode::READY_OP, fmt::format("Remote{}", id), "w" });
+            co_await local.receive(OpCode::RECEIVE_REQUEST_OP);
+            co_await local.send({ OpCode::ACCEPT_REQUEST_OP });
+            co_await remote.receive(OpCode::READY_OP);
+
+            // the local session plays black
+            State state { make_board(9) };
+            Connection* sides[] { &local, &remote };
+            for (auto turn { 0 }; steady_clock::now() < deadline; turn ^= 1) {
+                if (options.think > 0ms) {
+                    timer.expires_after(options.think);
+                    co_await timer.async_wait(use_awaitable);
+                }
+                auto move { choose_move(state, options.bot, random) };
+                if (!move) {
+                    co_await sides[turn]->send({ OpCode::GIVEUP_OP });
+                    break;
+                }
+                auto sent { steady_clock::now() };
+                co_await sides[turn]->send({ OpCode::MOVE_OP, move->to_string() });
+                auto received { co_await sides[turn ^ 1]->receive(OpCode::MOVE_OP) };
+                if (received.data1 != move->to_string())
+                    throw std::runtime_error { fmt::format("sent {}, received {}", move->to_string(), received.data1) };
+                latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - sent).count());
+                results.moves++;
+                state = state.next_state(*move);
+            }
+            results.games++;
+        } catch (std::exception& e) {
+            if (!results.errors++)
+                fmt::print(stderr, "game {}: {}\n", id, e.what());
+            failed = true;
+        }
+        results.merge(latencies);
+        if (std::exchange(failed, false)) {
+            asio::error_code ec;
+            timer.expires_after(100ms);
+            co_await timer.async_wait(asio::redirect_error(use_awaitable, ec));
+        }
+    }
+}
+
+auto main(int argc, char* argv[]) -> int
+{
+    if (argc < 4) {
+        std::cerr << "Usage: loadgen <host> <ui port> <peer port> [<games>] [<seconds>] [<think ms>] [random|bot]\n";
+        return 1;
+    }
+    Options options {
+        .host = argv[1],
+        .ui_port = integer_cast<asio::ip::port_type>(argv[2]),
+        .peer_port = integer_cast<asio::ip::port_type>(argv[3]),
+    };
+    if (argc > 4)
+        options.games = std::stoi(argv[4]);
+    if (argc > 5)
+        options.duration = seconds { std::stoi(argv[5]) };
+    if (argc > 6)
+        options.think = milliseconds { std::stoi(argv[6]) };
+    options.bot = argc > 7 && argv[7] == std::string_view { "bot" };
+
+    auto threads { std::max(1u, std::thread::hardware_concurrency()) };
+    asio::io_context io_context(threads);
+    Results results;
+    auto start { steady_clock::now() };
+    auto deadline { start + options.duration };
+    for (int id = 0; id < options.games; id++)
+        co_spawn(asio::make_strand(io_context), play(options, results, id, deadline), detached);
+
+    // progress once a second
+    asio::steady_timer progress { io_context };
+    std::function<void()> tick = [&] {
+        progress.expires_after(1s);
+        progress.async_wait([&](const asio::error_code& ec) {
+            if (ec || steady_clock::now() >= deadline)
+                return;
+            fmt::print("{}s: {} games, {} moves, {} errors\n", std::chrono::duration_cast<seconds>(steady_clock::now() - start).count(),
+                results.games.load(), results.moves.load(), results.errors.load());
+            tick();
+        });
+    };
+    tick();
+
+    std::vector<std::jthread> workers;
+    for (unsigned i = 1; i < threads; i++)
+        workers.emplace_back([&] { io_context.run(); });
+    io_context.run();
+    workers.clear();
+    results.report(std::chrono::duration_cast<seconds>(steady_clock::now() - start));
+    // for scripts: a run with errors, or without a single move, failed
+    return results.errors || !results.moves ? 2 : 0;
+}
@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <deque>
 #include <iostream>
+#include <limits>
 #include <ranges>
 #include <sstream>
 #include <string>
@@ -30,7 +31,17 @@ using asio::ip::tcp;
 
 #include <gtest/gtest.h>
 
+#include "../analysis.hpp"
+#include "../bitboard.hpp"
+#include "../metrics.hpp"
+#include "../pattern.hpp"
+#include "../selfplay.hpp"
+#include "../server.hpp"
+#include "../timingwheel.hpp"
+#include "../uimessage.hpp"
 #include "../utility.hpp"
+#include "../valuenet.hpp"
+#include "../wire.hpp"
 
 constexpr auto host = "127.0.0.1",
                port1 = "2333", port2 = "2334";
@@ -244,8 +255,1036 @@ TEST(nogo, server)
         }
     }
 }
+
+// the next message with op, skipping the UI states and whatever else comes first
+auto read_op(Session& session, OpCode op) -> Message
+{
+    for (;;) {
+        Message msg { session.do_read() };
+        if (msg.op == op)
+            return msg;
+    }
+}
+
+TEST(nogo, rooms)
+{
+    ServerProcess process {};
+
+    std::this_thread::sleep_for(3s);
+
+    auto local = launch_client(io_context, host, port1);
+    auto remote = launch_client(io_context, host, port2);
+    auto other = launch_client(io_context, host, port2);
+
+    std::this_thread::sleep_for(1s);
+
+    try {
+        local->do_write(R"({"op":100011,"data1":"Player1","data2":"30"})");
+        local->do_write(R"({"op":100024,"data1":"r1","data2":""})");
+        auto created { read_op(*local, OpCode::ROOM_RESULT_OP) };
+        EXPECT_EQ(created.data1, "success");
+        EXPECT_EQ(created.data2, "r1");
+
+        local->do_write(R"({"op":100024,"data1":"r1","data2":""})");
+        auto exists { read_op(*local, OpCode::ROOM_RESULT_OP) };
+        EXPECT_EQ(exists.data1, "failed");
+        EXPECT_EQ(exists.data2, "Room already exists");
+
+        remote->do_write(R"({"op":100025,"data1":"missing","data2":""})");
+        auto missing { read_op(*remote, OpCode::ROOM_RESULT_OP) };
+        EXPECT_EQ(missing.data1, "failed");
+        EXPECT_EQ(missing.data2, "Room not found");
+
+        // a request sent in the same write as the join goes to the new room
+        remote->do_write(R"({"op":100025,"data1":"r1","data2":""})"
+                         "\n"
+                         R"({"op":200000,"data1":"Player2","data2":"w"})");
+        auto joined { read_op(*remote, OpCode::ROOM_RESULT_OP) };
+        EXPECT_EQ(joined.data1, "success");
+        EXPECT_EQ(joined.data2, "r1");
+        auto request { read_op(*local, OpCode::RECEIVE_REQUEST_OP) };
+        EXPECT_EQ(request.data1, "Player2");
+
+        // the lobby does not see the room's chat
+        other->do_write(R"({"op":200008,"data1":"lobby","data2":""})");
+        local->do_write(R"({"op":100008,"data1":"room","data2":""})");
+        auto chat { read_op(*remote, OpCode::CHAT_OP) };
+        EXPECT_EQ(chat.data1, "room");
+    } catch (const std::exception& e) {
+        FAIL() << e.what();
+    }
+}
+
+TEST(nogo, loadgen)
+{
+    ServerProcess process {};
+
+    std::this_thread::sleep_for(3s);
+
+    // a few games, each a room of two sessions, without errors
+    EXPECT_EQ(system(fmt::format("./nogo-loadgen {} {} {} 8 3", host, port1, port2).c_str()), 0);
+}
+
+TEST(nogo, room_registry)
+{
+    RoomRegistry registry { io_context };
+    auto lobby { registry.lobby() };
+    EXPECT_EQ(registry.find(""), lobby);
+    EXPECT_EQ(registry.size(), 1);
+
+    auto r1 { registry.create("r1") };
+    EXPECT_EQ(r1->name, "r1");
+    EXPECT_EQ(registry.find("r1"), r1);
+    EXPECT_TRUE(registry.contains(*r1));
+    EXPECT_EQ(registry.find("missing"), nullptr);
+
+    // an empty or taken name is replaced by a generated one
+    auto generated { registry.create("") };
+    auto renamed { registry.create("r1") };
+    EXPECT_FALSE(generated->name.empty());
+    EXPECT_NE(renamed->name, "r1");
+    EXPECT_EQ(registry.find(generated->name), generated);
+    EXPECT_EQ(registry.find(renamed->name), renamed);
+    EXPECT_EQ(registry.size(), 4);
+
+    // the lobby is never released
+    registry.release(*lobby);
+    EXPECT_EQ(registry.lobby(), lobby);
+
+    registry.release(*r1);
+    EXPECT_EQ(registry.find("r1"), nullptr);
+    EXPECT_FALSE(registry.contains(*r1));
+    EXPECT_EQ(registry.size(), 3);
+
+    // a room released before is not the new room of the same name
+    auto again { registry.create("r1") };
+    EXPECT_TRUE(registry.contains(*again));
+    EXPECT_FALSE(registry.contains(*r1));
+    registry.release(*r1);
+    EXPECT_EQ(registry.find("r1"), again);
+    EXPECT_EQ(registry.size(), 4);
+}
+
+// a socket connected over loopback to peer
+auto connect_loopback(asio::io_context& context, tcp::socket& peer) -> tcp::socket
+{
+    tcp::acceptor acceptor { context, { asio::ip::address_v4::loopback(), 0 } };
+    peer.connect(acceptor.local_endpoint());
+    return acceptor.accept();
+}
+
+TEST(nogo, participant_registry)
+{
+    asio::io_context context;
+    RoomRegistry rooms { context };
+    tcp::socket peer1 { context }, peer2 { context };
+    auto local { std::make_shared<LocalSession>(connect_loopback(context, peer1), rooms.lobby(), "") };
+    auto remote { std::make_shared<RemoteSession>(connect_loopback(context, peer2), rooms.lobby(), "") };
+    ParticipantRegistry registry;
+
+    EXPECT_TRUE(registry.insert(local));
+    EXPECT_TRUE(registry.insert(remote));
+    EXPECT_FALSE(registry.insert(remote));
+    EXPECT_EQ(registry.size(), 2);
+    EXPECT_EQ(registry.local(), local);
+    EXPECT_EQ(registry.find(remote->id), remote);
+    EXPECT_EQ(registry.find_by_endpoint(remote->endpoint()), remote);
+    EXPECT_EQ(registry.find_by_endpoint(local->endpoint()), nullptr);
+    EXPECT_EQ(registry.find_by_name(remote->name), remote);
+
+    registry.rename(remote, "Player2");
+    EXPECT_EQ(remote->name, "Player2");
+    EXPECT_EQ(registry.find_by_name("Player2"), remote);
+    EXPECT_EQ(registry.find_by_name(::to_string(remote->endpoint())), nullptr);
+
+    // unnamed participants are found by address instead
+    registry.rename(remote, "");
+    auto address { remote->endpoint().address().to_string() };
+    EXPECT_EQ(std::ranges::distance(registry.find_unnamed(address)), 1);
+    EXPECT_EQ(registry.find_by_name("Player2"), nullptr);
+
+    EXPECT_TRUE(registry.erase(remote));
+    EXPECT_FALSE(registry.erase(remote));
+    EXPECT_EQ(registry.find(remote->id), nullptr);
+    EXPECT_EQ(registry.find_by_endpoint(remote->endpoint()), nullptr);
+    EXPECT_TRUE(std::ranges::empty(registry.find_unnamed(address)));
+
+    registry.erase_if([](auto& participant) { return participant->is_local; });
+    EXPECT_EQ(registry.local(), nullptr);
+    EXPECT_TRUE(registry.empty());
+}
+
+TEST(nogo, reader)
+{
+    asio::io_context context;
+    RoomRegistry rooms { context };
+    tcp::socket peer { context };
+    auto local { std::make_shared<LocalSession>(connect_loopback(context, peer), rooms.lobby(), "") };
+    auto saved { std::exchange(MAX_FRAME_SIZE, 1024) };
+    asio::co_spawn(context, local->reader(), asio::detached);
+    // the frames and bytes the reader takes from data
+    auto received = [&](string_view data) {
+        auto messages { metrics.in.messages.value() }, bytes { metrics.in.bytes.value() };
+        asio::write(peer, asio::buffer(data));
+        context.run_for(100ms);
+        return std::pair { metrics.in.messages.value() - messages, metrics.in.bytes.value() - bytes };
+    };
+    // a frame of size bytes that the room ignores
+    auto frame = [](std::size_t size) {
+        auto json { Message { OpCode::CHAT_USERNAME_UPDATE_OP }.to_string() };
+        json.insert(json.find(R"("data1":")") + 9, size - json.size(), 'x');
+        return json;
+    };
+
+    auto first { frame(50) }, second { frame(60) };
+    EXPECT_EQ(received(first + '\n' + second + '\n'), std::pair(2L, 110L));
+    auto longest { frame(MAX_FRAME_SIZE) };
+    EXPECT_EQ(received(longest.substr(0, 700)), std::pair(0L, 0L));
+    EXPECT_EQ(received(longest.substr(700) + '\n'), std::pair(1L, 1024L));
+
+    // one byte more ends the reader before its newline arrives
+    EXPECT_EQ(received(frame(MAX_FRAME_SIZE + 1)), std::pair(0L, 0L));
+    EXPECT_EQ(received('\n' + first + '\n'), std::pair(0L, 0L));
+    MAX_FRAME_SIZE = saved;
+}
+
+TEST(nogo, writer)
+{
+    asio::io_context context;
+    RoomRegistry rooms { context };
+    tcp::socket peer { context };
+    auto remote { std::make_shared<RemoteSession>(connect_loopback(context, peer), rooms.lobby(), "") };
+    asio::co_spawn(context, remote->writer(), asio::detached);
+    auto messages { metrics.out.messages.value() };
+
+    // queued in one turn: the control messages first, then the bulk ones, which a leaving
+    // peer gets all of before the LEAVE_OP
+    asio::post(context, [&] {
+        remote->enqueue({ OpCode::MOVE_OP, "A1" });
+        remote->enqueue({ OpCode::CHAT_OP, "hi" });
+        remote->enqueue({ OpCode::MOVE_OP, "B2" });
+        remote->enqueue({ OpCode::LEAVE_OP });
+    });
+    context.run_for(100ms);
+    string received;
+    asio::error_code ec;
+    asio::read(peer, asio::dynamic_buffer(received), ec);
+    EXPECT_EQ(ec, asio::error::eof);
+    EXPECT_EQ(received, fmt::format("{}\n{}\n{}\n{}\n", Message { OpCode::MOVE_OP, "A1" }.to_string(), Message { OpCode::MOVE_OP, "B2" }.to_string(),
+                            Message { OpCode::CHAT_OP, "hi" }.to_string(), Message { OpCode::LEAVE_OP }.to_string()));
+    EXPECT_EQ(metrics.out.messages.value() - messages, 4);
+}
+
+TEST(nogo, shed_load)
+{
+    asio::io_context context;
+    RoomRegistry rooms { context };
+    auto saved { std::tuple { MAX_QUEUED_MESSAGES, SLOW_CONSUMER_POLICY } };
+    MAX_QUEUED_MESSAGES = 8;
+    std::vector<tcp::socket> peers;
+    std::vector<std::shared_ptr<RemoteSession>> participants;
+    // a remote participant without a writer, after a burst of messages over its limit
+    auto overloaded = [&](SlowConsumerPolicy policy) {
+        SLOW_CONSUMER_POLICY = policy;
+        auto& peer { peers.emplace_back(context) };
+        auto& participant { participants.emplace_back(std::make_shared<RemoteSession>(connect_loopback(context, peer), rooms.lobby(), "")) };
+        for (auto [op, data1] : std::initializer_list<std::pair<OpCode, string>> {
+                 { OpCode::MOVE_OP, "A1" },
+                 { OpCode::UPDATE_UI_STATE_OP, "state1" },
+                 { OpCode::CHAT_OP, "chat" },
+                 { OpCode::UI_STATE_DELTA_OP, "delta1" },
+                 { OpCode::ANALYSIS_RESULT_OP, "analysis1" },
+                 { OpCode::UPDATE_UI_STATE_OP, "state2" },
+                 { OpCode::ANALYSIS_RESULT_OP, "analysis2" },
+                 { OpCode::MOVE_OP, "B2" },
+                 { OpCode::UI_STATE_DELTA_OP, "delta2" },
+             })
+            participant->enqueue(Message { op, data1, R"({"base":0})" });
+        return participant;
+    };
+    auto queued = [](const std::deque<Message>& lane) {
+        return lane | std::views::transform(&Message::data1) | ranges::to<vector<string>>();
+    };
+
+    // the newest UI state and analysis result are kept, the deltas are dropped
+    auto collapsed { overloaded(SlowConsumerPolicy::COLLAPSE) };
+    EXPECT_EQ(queued(collapsed->write_msgs), (vector<string> { "A1", "B2" }));
+    EXPECT_EQ(queued(collapsed->bulk_msgs), (vector<string> { "chat", "state2", "analysis2" }));
+    EXPECT_EQ(collapsed->queue_metrics.dropped, 4);
+    EXPECT_EQ(collapsed->queue_metrics.messages, 5);
+    EXPECT_TRUE(collapsed->overloaded);
+    EXPECT_FALSE(collapsed->stopping);
+
+    auto prioritised { overloaded(SlowConsumerPolicy::PRIORITY_ONLY) };
+    EXPECT_EQ(queued(prioritised->write_msgs), (vector<string> { "A1", "B2" }));
+    EXPECT_TRUE(prioritised->bulk_msgs.empty());
+    EXPECT_EQ(prioritised->queue_metrics.dropped, 7);
+
+    auto disconnected { overloaded(SlowConsumerPolicy::DISCONNECT) };
+    EXPECT_TRUE(disconnected->write_msgs.empty());
+    EXPECT_TRUE(disconnected->bulk_msgs.empty());
+    EXPECT_EQ(disconnected->queue_metrics.bytes, 0);
+    EXPECT_TRUE(disconnected->stopping);
+
+    // recovered once the writer drains the queues to half their limits
+    collapsed->check_recovered();
+    EXPECT_TRUE(collapsed->overloaded);
+    collapsed->queue_metrics.bytes -= Participant::queued_size(collapsed->bulk_msgs.front());
+    collapsed->bulk_msgs.pop_front();
+    collapsed->queue_metrics.messages = 4;
+    collapsed->check_recovered();
+    EXPECT_FALSE(collapsed->overloaded);
+    EXPECT_EQ(collapsed->shed_messages, MAX_QUEUED_MESSAGES);
+
+    context.run();
+    std::tie(MAX_QUEUED_MESSAGES, SLOW_CONSUMER_POLICY) = saved;
+}
+
+TEST(nogo, token_bucket)
+{
+    TokenBucket::clock::time_point start {};
+    TokenBucket bucket { .rate = 1000, .burst = 500, .refilled = start };
+    EXPECT_TRUE(bucket.available());
+    // a write may overdraw the bucket, and waits for the debt to be paid off
+    bucket.take(700);
+    EXPECT_FALSE(bucket.available());
+    EXPECT_EQ(bucket.wait(), 201ms);
+    bucket.refill(start + 100ms);
+    EXPECT_FALSE(bucket.available());
+    bucket.refill(start + 250ms);
+    EXPECT_TRUE(bucket.available());
+    EXPECT_DOUBLE_EQ(bucket.tokens, 50);
+    // never above the burst however long it waits
+    bucket.refill(start + 10s);
+    EXPECT_DOUBLE_EQ(bucket.tokens, 500);
+
+    TokenBucket unlimited { .rate = 0, .burst = 500 };
+    unlimited.take(1000);
+    EXPECT_TRUE(unlimited.available());
+}
+
+TEST(nogo, ui_state_coalescing)
+{
+    asio::io_context context;
+    RoomRegistry rooms { context };
+    auto room { rooms.create("r1") };
+    tcp::socket peer { context };
+    auto local { std::make_shared<LocalSession>(connect_loopback(context, peer), room, "") };
+    auto ops = [&] { return local->write_msgs | std::views::transform(&Message::op) | ranges::to<vector<OpCode>>(); };
+
+    // one state for however many changes a strand turn makes
+    asio::post(room->strand, [&] {
+        room->join(local);
+        room->deliver_ui_state(true);
+        room->deliver_ui_state();
+        room->deliver_ui_state();
+    });
+    context.run();
+    EXPECT_EQ(ops(), vector { OpCode::UPDATE_UI_STATE_OP });
+
+    // and a pending state goes out before a message that follows it
+    local->write_msgs.clear();
+    asio::post(room->strand, [&] {
+        room->deliver_ui_state();
+        room->deliver_to_local({ OpCode::CHAT_OP, "hi" });
+        room->deliver_ui_state();
+    });
+    context.restart();
+    context.run();
+    EXPECT_EQ(ops(), (vector { OpCode::UPDATE_UI_STATE_OP, OpCode::CHAT_OP, OpCode::UPDATE_UI_STATE_OP }));
+}
+
+TEST(nogo, spectator)
+{
+    asio::io_context context;
+    RoomRegistry rooms { context };
+    auto room { rooms.create("r1") };
+    tcp::socket peer1 { context }, peer2 { context };
+    auto local { std::make_shared<LocalSession>(connect_loopback(context, peer1), room, "") };
+    auto spectator { std::make_shared<RemoteSession>(connect_loopback(context, peer2), room, "") };
+    auto frames = [&] { return spectator->shared_msgs | std::views::transform(&SharedFrame::op) | ranges::to<vector<OpCode>>(); };
+
+    asio::post(room->strand, [&] {
+        room->join(local);
+        room->spectate(spectator);
+        // everything but leaving and moving on is ignored
+        room->process_data({ OpCode::READY_OP, "Spectator", "w" }, spectator);
+        room->process_data({ OpCode::CHAT_OP, "hi" }, spectator);
+        room->deliver_ui_state();
+        room->deliver_to_others({ OpCode::MOVE_OP, "E5" }, local);
+        room->deliver_to_others({ OpCode::CHAT_OP, "hi" }, local);
+    });
+    context.run();
+    EXPECT_TRUE(spectator->spectator);
+    EXPECT_FALSE(room->participants.contains(spectator));
+    EXPECT_FALSE(room->contest.players.contains(Role::WHITE));
+    // a snapshot on arrival, then the room's states and moves but not its chat; one shared
+    // frame serves every spectator
+    EXPECT_EQ(frames(), (vector { OpCode::UPDATE_UI_STATE_OP, OpCode::UPDATE_UI_STATE_OP, OpCode::MOVE_OP }));
+    EXPECT_TRUE(spectator->write_msgs.empty());
+    EXPECT_TRUE(std::ranges::none_of(local->write_msgs, [](auto& msg) { return msg.op == OpCode::CHAT_OP; }));
+
+    asio::post(room->strand, [&] { room->leave(spectator); });
+    context.restart();
+    context.run();
+    EXPECT_FALSE(spectator->spectator);
+    EXPECT_TRUE(room->spectators.empty());
+}
+
+TEST(nogo, bitboard)
+{
+    std::mt19937 gen { 2333 };
+    for (auto game : ranges::views::iota(0, 20)) {
+        State state { std::make_shared<Board<9>>() };
+        for (;;) {
+            BitBoard<9> bitboard { *state.board };
+            for (auto pos : state.board->index()) {
+                auto legal { !(*state.board)[pos] && !state.try_move(pos) };
+                EXPECT_EQ(bitboard.is_legal(pos, state.role), legal) << "game " << game << ", " << pos.to_string() << '\n'
+                                                                     << state.board->to_string();
+            }
+            auto actions { state.available_actions() };
+            if (actions.empty())
+                break;
+            state = state.next_state(actions[gen() % actions.size()]);
+        }
+    }
+}
+
+// pattern() against the 3x3 window and the pseudo liberties of the neighbour groups,
+// recomputed from scratch after every move
+TEST(nogo, pattern)
+{
+    std::mt19937 gen { 2333 };
+    vector<Position> ring;
+    for (auto dx : { -1, 0, 1 })
+        for (auto dy : { -1, 0, 1 })
+            if (dx || dy)
+                ring.emplace_back(dx, dy);
+    const std::array<Position, 4> orthogonal { Position { -1, 0 }, Position { 0, -1 }, Position { 0, 1 }, Position { 1, 0 } };
+    auto pseudo_liberties = [&](const BoardBase& board, Position p) {
+        vector<Position> group { p }, pending { p };
+        while (!pending.empty()) {
+            auto q { pending.back() };
+            pending.pop_back();
+            for (auto d : orthogonal) {
+                if (auto n { q + d }; board.in_border(n) && board[n] == board[p] && std::ranges::find(group, n) == group.end())
+                    group.push_back(n), pending.push_back(n);
+            }
+        }
+        auto count { 0 };
+        for (auto q : group)
+            for (auto d : orthogonal)
+                count += board.in_border(q + d) && !board[q + d];
+        return count;
+    };
+    auto expected_pattern = [&](const BoardBase& board, Position p) {
+        std::uint32_t code {};
+        for (int k = 0; k < 8; k++) {
+            auto q { p + ring[k] };
+            code |= (!board.in_border(q) ? 3u : board[q].map(1u, 2u, 0u)) << (2 * k);
+        }
+        for (int k = 0; k < 4; k++) {
+            auto q { p + ring[BoardBase::orthogonal_ring[k]] };
+            if (board.in_border(q) && board[q] && pseudo_liberties(board, q) <= 2)
+                code |= 1 << (16 + k);
+        }
+        return code;
+    };
+
+    for (auto game : ranges::views::iota(0, 20)) {
+        State state { std::make_shared<Board<9>>() };
+        // the same game with the colours swapped scores the same for the side to move
+        State swapped { std::make_shared<Board<9>>(), Role::WHITE };
+        for (;;) {
+            for (auto pos : state.board->index()) {
+                EXPECT_EQ(state.board->pattern(pos), expected_pattern(*state.board, pos)) << "game " << game << ", " << pos.to_string() << '\n'
+                                                                                          << state.board->to_string();
+                if (!(*state.board)[pos]) {
+                    EXPECT_EQ(pattern_table.score(*state.board, pos, state.role), pattern_table.score(*swapped.board, pos, swapped.role))
+                        << "game " << game << ", " << pos.to_string();
+                }
+            }
+            auto actions { state.available_actions() };
+            if (actions.empty())
+                break;
+            auto pos { actions[gen() % actions.size()] };
+            state = state.next_state(pos);
+            swapped = swapped.next_state(pos);
+        }
+    }
+}
+
+// analyse() on a tree with hand-set visits: the most visited root moves, each followed by
+// the most visited line below it
+TEST(nogo, analyse)
+{
+    MCTSOptions options {};
+    State state { std::make_shared<Board<9>>() };
+    auto root { std::make_shared<MCTSNode>(state, options) };
+    auto child = [](auto& node, Position pos, int visit, double quality) {
+        auto next { node->add_child(node->state.next_state(pos)) };
+        next->visit = visit, next->quality = quality;
+        return next;
+    };
+    child(root, { 0, 0 }, 5, 5);
+    auto best { child(root, { 4, 4 }, 20, 10) };
+    child(root, { 2, 2 }, 10, -10);
+    child(root, { 8, 8 }, 0, 0);
+    child(best, { 3, 3 }, 3, 0);
+    auto reply { child(best, { 5, 5 }, 12, 0) };
+    child(reply, { 6, 6 }, 7, 0);
+
+    auto candidates { analyse(*root, 2) };
+    ASSERT_EQ(candidates.size(), 2);
+    EXPECT_EQ(candidates[0].move, "E5");
+    EXPECT_EQ(candidates[0].visits, 20);
+    EXPECT_DOUBLE_EQ(candidates[0].winrate, 0.75);
+    EXPECT_EQ(candidates[0].pv, (vector<string> { "E5", "F6", "G7" }));
+    EXPECT_EQ(candidates[1].move, "C3");
+    EXPECT_DOUBLE_EQ(candidates[1].winrate, 0);
+    EXPECT_EQ(candidates[1].pv, vector<string> { "C3" });
+
+    // unvisited moves are left out, and lines are cut at max_depth
+    candidates = analyse(*root, 10, 2);
+    ASSERT_EQ(candidates.size(), 3);
+    EXPECT_EQ(candidates[2].move, "A1");
+    EXPECT_EQ(candidates[0].pv, (vector<string> { "E5", "F6" }));
+}
+
+// a tree handed to tree_reclaimer is freed on its thread, deep trees included
+TEST(nogo, tree_reclaimer)
+{
+    MCTSOptions options {};
+    auto root { std::make_shared<MCTSNode>(State {}, options) };
+    auto node { root };
+    for (int depth = 0; depth < 4000; depth++) {
+        auto child { std::make_shared<MCTSNode>(node->state, options, node) };
+        node->children.push_back(child);
+        node = child;
+    }
+    std::weak_ptr<MCTSNode> leaf { std::exchange(node, nullptr) };
+    tree_reclaimer.reclaim(std::move(root));
+    for (int i = 0; i < 100 && !leaf.expired(); i++)
+        std::this_thread::sleep_for(10ms);
+    EXPECT_TRUE(leaf.expired());
+}
+
+// PlayoutBatch against the same playouts on State: lanes draw from the shared generator in
+// turn, each picking among its candidate points, dropping illegal ones and restoring all
+// empty points after a move
+TEST(nogo, playout_batch)
+{
+    constexpr int LANES { PLAYOUT_LANES };
+    for (auto seed : ranges::views::iota(0, 20)) {
+        std::mt19937 gen { std::uint32_t(seed) };
+        std::array<State, LANES> starts;
+        for (auto& state : starts) {
+            for (auto moves { gen() % 20 }; moves--;) {
+                auto actions { state.available_actions() };
+                state = state.next_state(actions[gen() % actions.size()]);
+            }
+        }
+
+        struct Lane {
+            State state;
+            std::vector<Position> candidates;
+            Role winner {};
+        };
+        auto empty_points = [](const State& state) {
+            return state.board->index() | ranges::views::filter([&](auto pos) { return !(*state.board)[pos]; }) | ranges::to<vector>();
+        };
+        std::array<Lane, LANES> expected;
+        for (int lane = 0; lane < LANES; lane++)
+            expected[lane] = { starts[lane], empty_points(starts[lane]) };
+        auto batch_gen { gen };
+        for (auto remaining { LANES }; remaining;) {
+            for (auto& lane : expected) {
+                if (lane.winner)
+                    continue;
+                if (lane.candidates.empty()) {
+                    lane.winner = -lane.state.role;
+                    remaining--;
+                    continue;
+                }
+                auto n { std::uniform_int_distribution<int> { 0, int(lane.candidates.size()) - 1 }(gen) };
+                auto pos { lane.candidates[n] };
+                if (lane.state.try_move(pos)) {
+                    lane.candidates.erase(lane.candidates.begin() + n);
+                } else {
+                    lane.state = lane.state.next_state(pos);
+                    lane.candidates = empty_points(lane.state);
+                }
+            }
+        }
+
+        std::array<const State*, LANES> states;
+        for (int lane = 0; lane < LANES; lane++)
+            states[lane] = &starts[lane];
+        auto winners { PlayoutBatch<9, LANES>::run(states, batch_gen) };
+        for (int lane = 0; lane < LANES; lane++)
+            EXPECT_EQ(winners[lane], expected[lane].winner) << "seed " << seed << ", lane " << lane;
+    }
+}
+
+// records written through SelfPlayFile::Writer, decoded chunk by chunk
+TEST(nogo, selfplay_file)
+{
+    constexpr auto path { "selfplay_test" };
+    std::mt19937 gen { 2333 };
+    for (auto compress : { false, true }) {
+        vector<std::tuple<State, Role, vector<std::pair<Position, int>>>> written;
+        {
+            SelfPlayFile file { path };
+            SelfPlayFile::Writer writer { file, compress };
+            State state { make_board(11) };
+            for (auto actions { state.available_actions() }; !actions.empty(); actions = state.available_actions()) {
+                vector<std::pair<Position, int>> visits;
+                for (auto pos : actions | ranges::views::take(5))
+                    visits.emplace_back(pos, int(gen() % 100000));
+                auto outcome { gen() % 2 ? Role::BLACK : Role::WHITE };
+                writer.append(state, outcome, visits);
+                written.emplace_back(state, outcome, std::move(visits));
+                // a second chunk
+                if (written.size() == 10)
+                    writer.flush();
+                state = state.next_state(actions[gen() % actions.size()]);
+            }
+        }
+
+        std::ifstream is { path, std::ios::binary };
+        std::size_t next { 0 }, chunks { 0 };
+        while (is.peek() != EOF) {
+            auto header { ChunkHeader::read(is) };
+            chunks++;
+            EXPECT_EQ(bool(header.flags & ChunkHeader::COMPRESSED), compress);
+            vector<std::uint8_t> stored(header.stored_size), raw(header.raw_size);
+            ASSERT_TRUE(is.read(reinterpret_cast<char*>(stored.data()), stored.size()));
+            if (compress) {
+                uLongf size { raw.size() };
+                ASSERT_EQ(uncompress(raw.data(), &size, stored.data(), stored.size()), Z_OK);
+                ASSERT_EQ(size, raw.size());
+            } else {
+                raw = stored;
+            }
+            std::size_t i { 0 };
+            for (std::uint32_t record = 0; record < header.records; record++, next++) {
+                ASSERT_LT(next, written.size());
+                auto& [state, outcome, visits] = written[next];
+                auto rank { state.board->get_rank() };
+                EXPECT_EQ(raw[i++], rank);
+                EXPECT_EQ(std::int8_t(raw[i++]), state.role.id);
+                EXPECT_EQ(std::int8_t(raw[i++]), outcome == state.role ? 1 : -1);
+                for (int point = 0; point < rank * rank; point++) {
+                    auto role { (*state.board)[{ point / rank, point % rank }] };
+                    EXPECT_EQ(raw[i + point / 4] >> (2 * (point % 4)) & 3, role.map(1, 2, 0));
+                }
+                i += (rank * rank + 3) / 4;
+                EXPECT_EQ(raw[i++], visits.size());
+                for (auto [pos, visit] : visits) {
+                    EXPECT_EQ(raw[i++], pos.x * rank + pos.y);
+                    EXPECT_EQ(raw[i] | raw[i + 1] << 8, std::min(visit, 0xffff));
+                    i += 2;
+                }
+            }
+            EXPECT_EQ(i, raw.size());
+        }
+        EXPECT_EQ(next, written.size());
+        EXPECT_EQ(chunks, 2);
+    }
+    std::remove(path);
+}
+
+// hidden sizes of 40 and 36 run both the 32 wide AVX2 loop of dot() and its scalar tail; the
+// whole of each dot() is the scalar fallback in builds without AVX2
+TEST(nogo, value_network)
+{
+    std::mt19937 gen { 2333 };
+    std::uniform_int_distribution<int> weight { -128, 127 }, bias { -2000, 2000 };
+    auto fill = [&](ValueNetwork::Layer& layer, int inputs, int outputs, float scale) {
+        layer.inputs = inputs, layer.outputs = outputs;
+        layer.weights.resize(std::size_t(inputs) * outputs);
+        std::ranges::generate(layer.weights, [&] { return weight(gen); });
+        layer.biases.resize(outputs);
+        std::ranges::generate(layer.biases, [&] { return bias(gen); });
+        layer.scales.assign(outputs, scale);
+    };
+    ValueNetwork written;
+    written.rank = 9, written.hidden1 = 40, written.hidden2 = 36;
+    fill(written.input, ValueNetwork::PLANES * 81, 40, 1 / 64.f);
+    fill(written.hidden, 40, 36, 1 / 256.f);
+    fill(written.value, 36, 1, 1 / 8192.f);
+    fill(written.policy, 36, 81, 1 / 1024.f);
+    std::stringstream file;
+    written.save(file);
+    auto network { ValueNetwork::load(file) };
+
+    auto activate = [](double acc, float scale) { return std::clamp<long>(std::lround(acc * scale), 0, 127); };
+    State state {};
+    for (auto move : ranges::views::iota(0, 30)) {
+        vector<long> h1(40), h2(36);
+        for (int j = 0; j < 40; j++) {
+            double acc { double(network.input.biases[j]) };
+            for (auto i : network.encode(state))
+                acc += network.input.weights[i * 40 + j];
+            h1[j] = activate(acc, network.input.scales[j]);
+        }
+        for (int k = 0; k < 36; k++) {
+            double acc { double(network.hidden.biases[k]) };
+            for (int j = 0; j < 40; j++)
+                acc += h1[j] * network.hidden.weights[k * 40 + j];
+            h2[k] = activate(acc, network.hidden.scales[k]);
+        }
+        auto output_of = [&](const ValueNetwork::Layer& layer, int c) {
+            double acc { double(layer.biases[c]) };
+            for (int k = 0; k < 36; k++)
+                acc += h2[k] * layer.weights[c * 36 + k];
+            return acc * layer.scales[c];
+        };
+
+        auto output { network.evaluate(state) };
+        EXPECT_NEAR(output.value, std::tanh(output_of(network.value, 0)), 1e-6) << "move " << move;
+        ASSERT_EQ(output.policy.size(), 81);
+        for (int c = 0; c < 81; c++)
+            EXPECT_NEAR(output.policy[c], output_of(network.policy, c), 1e-3) << "move " << move << ", point " << c;
+
+        auto actions { state.available_actions() };
+        if (actions.empty())
+            break;
+        state = state.next_state(actions[gen() % actions.size()]);
+    }
+}
+
+// what a client does with UI_STATE_DELTA_OP
+auto apply_delta(nlohmann::json state, const nlohmann::json& delta) -> nlohmann::json
+{
+    auto& game { state["game"] };
+    for (auto& cell : delta.value("cells", nlohmann::json::array()))
+        game["chessboard"][cell[0].get<int>()][cell[1].get<int>()] = cell[2];
+    auto& disabled { game["disabled_positions"] };
+    for (auto& pos : delta.value("enabled", nlohmann::json::array()))
+        disabled.erase(std::ranges::find(disabled, pos));
+    for (auto& pos : delta.value("disabled", nlohmann::json::array()))
+        disabled.push_back(pos);
+    if (delta.contains("encoded_append"))
+        game["encoded"] = game["encoded"].get<string>() + delta["encoded_append"].get<string>();
+    if (delta.contains("game"))
+        game.update(delta["game"]);
+    for (auto key : { "game_result", "is_gaming", "status" }) {
+        if (delta.contains(key))
+            state[key] = delta[key];
+    }
+    // a set, the order of which the delta does not keep
+    std::sort(disabled.begin(), disabled.end());
+    return state;
+}
+
+TEST(nogo, ui_state_delta)
+{
+    Contest contest { { Player { nullptr, "Player1", Role::BLACK, PlayerType::LOCAL_HUMAN_PLAYER },
+        Player { nullptr, "Player2", Role::WHITE, PlayerType::REMOTE_HUMAN_PLAYER } } };
+    contest.local_role = Role::BLACK;
+    contest.duration = 30s;
+    std::mt19937 gen { 2333 };
+    std::vector<UiMessage::UiState> states { UiMessage::UiState { contest } };
+    while (contest.status == Contest::Status::ON_GOING) {
+        auto player { contest.players.at(contest.current.role) };
+        auto actions { contest.current.available_actions() };
+        if (actions.empty())
+            contest.concede(player);
+        else
+            contest.play(player, actions[gen() % actions.size()]);
+        std::vector<UiMessage::DynamicStatistics> statistics;
+        if (states.size() % 3)
+            statistics.push_back({ "tree_size", "Tree size", std::to_string(states.size()) });
+        states.emplace_back(contest, std::move(statistics));
+    }
+    ASSERT_GT(states.size(), 10);
+    auto normalised = [](const UiMessage::UiState& state) {
+        auto json = nlohmann::json::parse(state.to_string());
+        auto& disabled { json["game"]["disabled_positions"] };
+        std::sort(disabled.begin(), disabled.end());
+        return json;
+    };
+    for (std::size_t i = 1; i < states.size(); i++) {
+        for (auto base : { i - 1, i < 5 ? 0 : i - 5 }) {
+            auto delta { states[i].delta(states[base], base) };
+            ASSERT_TRUE(delta) << "state " << i;
+            auto parsed = nlohmann::json::parse(*delta);
+            EXPECT_EQ(parsed["base"], base);
+            EXPECT_EQ(apply_delta(normalised(states[base]), parsed), normalised(states[i])) << "from " << base << " to " << i << ": " << *delta;
+        }
+    }
+    EXPECT_EQ(states.back().delta(states.back(), 0), "");
+}
+
+// Contest::ui_view() worked out from the moves alone, on a new board
+void expect_view_of_moves(const Contest& contest)
+{
+    auto rank { contest.board_size };
+    State state { make_board(rank) };
+    std::vector<std::vector<int>> chessboard(rank, std::vector<int>(rank));
+    for (auto pos : contest.moves) {
+        chessboard[pos.x][pos.y] = state.role.id;
+        state = state.next_state(pos);
+    }
+    std::vector<Position> disabled;
+    auto actions { state.available_actions() };
+    for (int x = 0; x < rank; x++) {
+        for (int y = 0; y < rank; y++) {
+            if (!chessboard[x][y] && std::ranges::find(actions, Position { x, y }) == actions.end())
+                disabled.emplace_back(x, y);
+        }
+    }
+
+    auto& view { contest.ui_view() };
+    EXPECT_EQ(view.chessboard, chessboard);
+    auto view_disabled { view.disabled_positions };
+    std::ranges::sort(view_disabled, {}, [](auto pos) { return std::pair { pos.x, pos.y }; });
+    EXPECT_EQ(view_disabled, disabled);
+    EXPECT_EQ(view.moves, fmt::format("{}", fmt::join(contest.moves | std::views::transform([](auto pos) { return pos.to_string(); }), " ")));
+}
+
+TEST(nogo, ui_view)
+{
+    PlayerList players { Player { nullptr, "BLACK", Role::BLACK, PlayerType::LOCAL_HUMAN_PLAYER },
+        Player { nullptr, "WHITE", Role::WHITE, PlayerType::LOCAL_HUMAN_PLAYER } };
+    std::mt19937 gen { 2333 };
+    auto play = [&](Contest& contest, int count) {
+        for (int i = 0; i < count && contest.status == Contest::Status::ON_GOING; i++) {
+            auto actions { contest.current.available_actions() };
+            if (actions.empty())
+                break;
+            contest.play(contest.players.at(contest.current.role), actions[gen() % actions.size()]);
+            // the view is updated by play() when it was up to date, and rebuilt otherwise
+            if (i % 3)
+                expect_view_of_moves(contest);
+        }
+        expect_view_of_moves(contest);
+    };
+
+    Contest contest { players };
+    expect_view_of_moves(contest);
+    play(contest, 100);
+    auto moves { contest.moves };
+    auto view { contest.ui_view() };
+    contest.concede(contest.players.at(contest.current.role));
+    expect_view_of_moves(contest);
+
+    contest.clear();
+    expect_view_of_moves(contest);
+    contest.set_board_size(11);
+    expect_view_of_moves(contest);
+    contest.reject();
+    for (auto role : { Role::BLACK, Role::WHITE })
+        contest.enroll(Player { players.at(role) });
+    play(contest, 30);
+    EXPECT_EQ(contest.board_size, 11);
+
+    // a replay of the first game
+    contest = Contest { players };
+    contest.is_replaying = true;
+    for (auto pos : moves) {
+        contest.play(contest.players.at(contest.current.role), pos);
+        expect_view_of_moves(contest);
+    }
+    EXPECT_EQ(contest.ui_view().chessboard, view.chessboard);
+    EXPECT_EQ(contest.ui_view().moves, view.moves);
+}
+
+TEST(nogo, wire)
+{
+    std::vector<Message> messages {
+        { OpCode::MOVE_OP, "E5" },
+        { OpCode::MOVE_OP, "M13", "b" },
+        { OpCode::CHAT_OP, "A14 is not a point", "E05" },
+        { OpCode::BOT_HOSTING_OP, std::string(1000, 'x') },
+        { OpCode::READY_OP },
+    };
+    std::string out;
+    for (auto& msg : messages)
+        wire::append_binary(out, msg);
+    EXPECT_EQ(out.substr(0, 6), std::string("\x00\x04\x02\xf0\x38\x00", 6));
+
+    std::string_view data { out };
+    for (auto& msg : messages) {
+        ASSERT_EQ(data[0], wire::BINARY_FRAME);
+        auto header { wire::read_header(data.substr(1)) };
+        ASSERT_TRUE(header);
+        auto decoded { wire::parse_binary(data.substr(1 + header->second, header->first)) };
+        EXPECT_EQ(decoded.to_string(), msg.to_string());
+        data.remove_prefix(1 + header->second + header->first);
+    }
+    EXPECT_TRUE(data.empty());
+}
+
+TEST(nogo, varint)
+{
+    for (std::uint64_t value : { 0uL, 127uL, 128uL, 16383uL, 16384uL, std::numeric_limits<std::uint64_t>::max() }) {
+        std::string out;
+        wire::append_varint(out, value);
+        EXPECT_EQ(out.size(), wire::varint_size(value));
+        auto read { wire::read_varint(out) };
+        ASSERT_TRUE(read) << value;
+        EXPECT_EQ(read->first, value);
+        EXPECT_EQ(read->second, out.size());
+        // truncated, or followed by more data
+        EXPECT_EQ(wire::read_varint(std::string_view { out }.substr(0, out.size() - 1)), std::nullopt);
+        EXPECT_EQ(wire::read_varint(out + "\x05")->second, out.size());
+    }
+    EXPECT_EQ(wire::varint_size(127), 1);
+    EXPECT_EQ(wire::varint_size(128), 2);
+    EXPECT_EQ(wire::varint_size(std::numeric_limits<std::uint64_t>::max()), 10);
+    EXPECT_THROW(wire::read_varint(std::string(10, '\x80')), std::runtime_error);
+}
+
+TEST(nogo, json_codec)
+{
+    std::vector<Message> messages {
+        { OpCode::MOVE_OP, "E5" },
+        { OpCode::CHAT_OP, "say \"hi\"\\\n\t\x01\x1f/", "\x7f" },
+        { OpCode::CHAT_OP, "你好", "café" },
+        { OpCode::READY_OP },
+    };
+    for (auto& msg : messages) {
+        auto s { msg.to_string() };
+        EXPECT_EQ(s, nlohmann::json(msg).dump());
+        EXPECT_EQ(Message(s).to_string(), s);
+    }
+    Message spaced { R"( { "op" : 200002, "data2" : "", "data1" : "E5", "extra" : 1 } )"sv };
+    EXPECT_EQ(spaced.to_string(), Message(OpCode::MOVE_OP, "E5").to_string());
+    EXPECT_ANY_THROW(Message(R"({"op":200002,"data1":"E5"})"sv));
+
+    // what RFC 8259 does not allow is rejected, not read leniently
+    for (auto json : {
+             R"({"op":0200002,"data1":"E5","data2":""})"sv,
+             R"({"op":-0200002,"data1":"E5","data2":""})"sv,
+             R"({"op":+200002,"data1":"E5","data2":""})"sv,
+             R"({"op":200002.,"data1":"E5","data2":""})"sv,
+             R"({"op":0x30d42,"data1":"E5","data2":""})"sv,
+             "{\"op\":200002,\"data1\":\"E5\t\",\"data2\":\"\"}"sv,
+             R"({"op":200002,"data1":"E5\x","data2":""})"sv,
+             R"({"op":200002,"data1":"E5","data2":""},)"sv,
+         })
+        EXPECT_ANY_THROW(Message { json }) << json;
+    EXPECT_EQ(Message(R"({"op":0,"data1":"","data2":""})"sv).op, OpCode(0));
+}
+
+TEST(nogo, timing_wheel)
+{
+    asio::io_context context;
+    auto wheel { std::make_shared<TimingWheel>(context) };
+    auto start { TimingWheel::clock::now() };
+    vector<std::pair<string, TimingWheel::clock::duration>> fired;
+    auto record = [&](string name) {
+        return [&, name] { fired.emplace_back(name, TimingWheel::clock::now() - start); };
+    };
+
+    TimingWheel::Timer late { wheel, context.get_executor() }, early { wheel, context.get_executor() },
+        cancelled { wheel, context.get_executor() }, rearmed { wheel, context.get_executor() };
+    late.expires_after(1500ms, record("late")); // through the second wheel
+    early.expires_after(30ms, record("early"));
+    cancelled.expires_after(20ms, record("cancelled"));
+    rearmed.expires_after(10ms, record("rearmed"));
+    cancelled.cancel();
+    rearmed.expires_after(100ms, record("rearmed"));
+    EXPECT_EQ(wheel->size(), 3);
+    EXPECT_EQ(cancelled.expiry(), TimingWheel::clock::time_point::max());
+
+    // returns once the wheel stops ticking, with nothing armed
+    context.run();
+    ASSERT_EQ(fired.size(), 3);
+    EXPECT_EQ(fired[0].first, "early");
+    EXPECT_EQ(fired[1].first, "rearmed");
+    EXPECT_EQ(fired[2].first, "late");
+    EXPECT_GE(fired[0].second, 30ms);
+    EXPECT_GE(fired[1].second, 100ms);
+    EXPECT_GE(fired[2].second, 1500ms);
+    EXPECT_EQ(wheel->size(), 0);
+
+    // the wheel sleeps through the empty slots rather than waking every TICK, and wakes
+    // early for a timer armed with a nearer deadline
+    context.restart();
+    fired.clear();
+    start = TimingWheel::clock::now();
+    late.expires_after(1s, record("late"));
+    asio::post(context, [&] { early.expires_after(50ms, record("early")); });
+    auto handlers { context.run() };
+    ASSERT_EQ(fired.size(), 2);
+    EXPECT_EQ(fired[0].first, "early");
+    EXPECT_GE(fired[0].second, 50ms);
+    EXPECT_LT(fired[0].second, 500ms);
+    EXPECT_GE(fired[1].second, 1s);
+    EXPECT_LT(handlers, 20);
+}
+
+TEST(nogo, log_level)
+{
+    EXPECT_EQ(parse_log_level("debug"), spdlog::level::debug);
+    EXPECT_EQ(parse_log_level("warn"), spdlog::level::warn);
+    EXPECT_EQ(parse_log_level("off"), spdlog::level::off);
+    // unknown names are rejected rather than turning logging off
+    for (auto name : { "verbose", "", "Debug ", "offf" })
+        EXPECT_EQ(parse_log_level(name), std::nullopt) << name;
+}
+
+TEST(nogo, latency_histogram)
+{
+    LatencyHistogram histogram;
+    for (std::uint64_t value = 1; value <= 100000; value++)
+        histogram.record(value);
+    EXPECT_EQ(histogram.count(), 100000);
+    EXPECT_EQ(histogram.maximum(), 100000);
+    EXPECT_DOUBLE_EQ(histogram.mean(), 50000.5);
+    for (auto q : { 0.5, 0.99, 0.999 }) {
+        auto exact { q * 100000 };
+        EXPECT_GE(histogram.percentile(q), exact);
+        EXPECT_LE(histogram.percentile(q), exact * 1.125);
+    }
+    histogram.record(3);
+    EXPECT_EQ(histogram.percentile(0), 1);
+    histogram.reset();
+    EXPECT_EQ(histogram.count(), 0);
+    EXPECT_EQ(histogram.percentile(0.5), 0);
+    // what is exported as counters keeps growing
+    histogram.record(7);
+    EXPECT_EQ(histogram.cumulative_count(), 100002);
+    EXPECT_EQ(histogram.cumulative_sum(), 5000050000 + 3 + 7);
+}
+
+TEST(nogo, metrics_reset)
+{
+    ServerMetrics metrics;
+    metrics.record(ServerMetrics::Stage::HANDLE, OpCode::MOVE_OP, 2ms);
+    metrics.in.record(100);
+    metrics.reset();
+    metrics.record(ServerMetrics::Stage::HANDLE, OpCode::MOVE_OP, 1ms);
+    auto json = metrics.to_json();
+    EXPECT_EQ(json["latency"]["200002"]["handle"]["count"], 1);
+    EXPECT_EQ(json["in"]["messages"], 1);
+    auto text { metrics.to_prometheus() };
+    EXPECT_NE(text.find("nogo_latency_seconds_count{op=\"200002\",stage=\"handle\"} 2\n"), string::npos) << text;
+    EXPECT_NE(text.find("nogo_latency_seconds_sum{op=\"200002\",stage=\"handle\"} 0.003\n"), string::npos) << text;
+    EXPECT_NE(text.find("nogo_messages_total{direction=\"in\"} 1\n"), string::npos) << text;
+}
+
+TEST(nogo, sharded_counter)
+{
+    ShardedCounter counter;
+    {
+        std::vector<std::jthread> threads;
+        for (int i = 0; i < 8; i++)
+            threads.emplace_back([&] {
+                for (int n = 0; n < 10000; n++)
+                    counter.add();
+                counter.add(-5000);
+            });
+    }
+    EXPECT_EQ(counter.value(), 8 * 5000);
+}
+
 int main(int argc, char* argv[])
 {
     testing::InitGoogleTest();
     return RUN_ALL_TESTS();
-}
\ No newline at end of file
+}
@@ -0,0 +1,261 @@
+#pragma once
+#ifndef _EXPORT
+#define _EXPORT
+#endif
+
+#include <asio/any_io_executor.hpp>
+#include <asio/io_context.hpp>
+#include <asio/post.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/strand.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// The deadlines of the whole server on one asio::steady_timer: a hierarchical timing wheel
+// of LEVELS wheels of SLOTS slots, a slot of the first one being TICK and of every next one
+// SLOTS times longer. Arming and cancelling a Timer links and unlinks it in the list of a
+// slot; a timer in a coarse slot moves to a finer wheel when its slot comes up. Deadlines
+// are rounded up to the next TICK, and the wheel wakes only for the ticks that fire timers or
+// move them to a finer wheel.
+_EXPORT class TimingWheel : public std::enable_shared_from_this<TimingWheel> {
+public:
+    using clock = std::chrono::steady_clock;
+    static constexpr clock::duration TICK { std::chrono::milliseconds { 10 } };
+    static constexpr int SLOT_BITS { 6 }, SLOTS { 1 << SLOT_BITS }, LEVELS { 4 };
+
+    class Timer;
+
+private:
+    struct Node {
+        Node* prev { this };
+        Node* next { this };
+
+        void unlink()
+        {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = this;
+        }
+        void link_before(Node& node)
+        {
+            prev = node.prev;
+            next = &node;
+            node.prev->next = this;
+            node.prev = this;
+        }
+    };
+    struct Entry : Node, std::enable_shared_from_this<Entry> {
+        std::shared_ptr<TimingWheel> wheel;
+        asio::any_io_executor executor;
+        std::function<void()> handler;
+        std::uint64_t tick {};
+        std::uint64_t generation {}; // bumped by every arm and cancel
+        clock::time_point expiry { clock::time_point::max() };
+        bool linked {};
+    };
+
+    std::mutex mutex;
+    asio::strand<asio::io_context::executor_type> strand;
+    asio::steady_timer timer;
+    const clock::time_point origin { clock::now() };
+    std::uint64_t current {}; // the last tick processed
+    std::uint64_t scheduled {}; // the tick timer waits for while running
+    std::size_t armed {};
+    bool running {};
+    std::array<std::array<Node, SLOTS>, LEVELS> slots;
+
+    // a tick not before current
+    void link(Entry& entry)
+    {
+        auto tick { entry.tick };
+        auto level { 0 };
+        while (level < LEVELS - 1 && (tick >> SLOT_BITS * level) - (current >> SLOT_BITS * level) >= SLOTS)
+            level++;
+        // beyond the last wheel: wait in its farthest slot
+        tick = std::min(tick, ((current >> SLOT_BITS * level) + SLOTS - 1) << SLOT_BITS * level);
+        entry.link_before(slots[level][(tick >> SLOT_BITS * level) & (SLOTS - 1)]);
+    }
+
+    // the next tick after current that fires timers or moves them to a finer wheel: a slot of
+    // a wheel holds timers no more than SLOTS - 1 of its slots ahead
+    auto next_tick() const -> std::uint64_t
+    {
+        auto next { std::numeric_limits<std::uint64_t>::max() };
+        for (auto level { 0 }; level < LEVELS; level++) {
+            auto shift { SLOT_BITS * level };
+            for (auto slot { (current >> shift) + 1 }; slot < (current >> shift) + SLOTS; slot++) {
+                auto& head { slots[level][slot & (SLOTS - 1)] };
+                if (head.next != &head) {
+                    next = std::min(next, slot << shift);
+                    break;
+                }
+            }
+        }
+        return next;
+    }
+
+    void advance(std::vector<std::pair<std::shared_ptr<Entry>, std::uint64_t>>& fired)
+    {
+        auto now { std::uint64_t((clock::now() - origin) / TICK) };
+        while (armed) {
+            // nothing happens in the ticks before
+            auto next { next_tick() };
+            if (next > now)
+                break;
+            current = next;
+            auto level { 1 };
+            while (level < LEVELS && !(current & ((std::uint64_t { 1 } << SLOT_BITS * level) - 1)))
+                level++;
+            for (level--; level > 0; level--) {
+                auto& head { slots[level][(current >> SLOT_BITS * level) & (SLOTS - 1)] };
+                Node pending;
+                if (head.next != &head) {
+                    // move the whole list, then spread it over the finer wheels
+                    pending.next = head.next, pending.prev = head.prev;
+                    pending.next->prev = pending.prev->next = &pending;
+                    head.prev = head.next = &head;
+                }
+                while (pending.next != &pending) {
+                    auto& entry { static_cast<Entry&>(*pending.next) };
+                    entry.unlink();
+                    link(entry);
+                }
+            }
+            auto& head { slots[0][current & (SLOTS - 1)] };
+            while (head.next != &head) {
+                auto& entry { static_cast<Entry&>(*head.next) };
+                entry.unlink();
+                entry.linked = false;
+                armed--;
+                fired.emplace_back(entry.shared_from_this(), entry.generation);
+            }
+        }
+        current = std::max(current, now);
+    }
+
+    // also when a timer armed since is due before the tick timer waits for
+    void schedule()
+    {
+        if (!armed)
+            return;
+        auto next { next_tick() };
+        if (running && next >= scheduled)
+            return;
+        running = true;
+        scheduled = next;
+        timer.expires_at(origin + TICK * next);
+        timer.async_wait([wheel = shared_from_this()](const asio::error_code& ec) {
+            if (ec)
+                return;
+            wheel->on_tick();
+        });
+    }
+
+    void on_tick()
+    {
+        std::vector<std::pair<std::shared_ptr<Entry>, std::uint64_t>> fired;
+        {
+            std::lock_guard guard { mutex };
+            running = false;
+            advance(fired);
+            schedule();
+        }
+        for (auto& [entry, generation] : fired) {
+            asio::post(entry->executor, [entry, generation] {
+                std::function<void()> handler;
+                {
+                    std::lock_guard guard { entry->wheel->mutex };
+                    // cancelled or armed again after it fired
+                    if (entry->generation != generation)
+                        return;
+                    entry->expiry = clock::time_point::max();
+                    handler = std::move(entry->handler);
+                }
+                handler();
+            });
+        }
+    }
+
+public:
+    explicit TimingWheel(asio::io_context& io_context)
+        : strand { asio::make_strand(io_context) }
+        , timer { strand }
+    {
+    }
+
+    auto size() -> std::size_t
+    {
+        std::lock_guard guard { mutex };
+        return armed;
+    }
+};
+
+// One deadline at a time, like an asio::steady_timer whose handler runs on executor. Arming
+// it again or cancelling it drops the pending handler, even one the wheel already fired.
+_EXPORT class TimingWheel::Timer {
+    std::shared_ptr<Entry> entry;
+
+    void unlink()
+    {
+        auto& wheel { *entry->wheel };
+        entry->generation++;
+        entry->expiry = clock::time_point::max();
+        if (entry->linked) {
+            entry->unlink();
+            entry->linked = false;
+            wheel.armed--;
+        }
+    }
+
+public:
+    Timer(std::shared_ptr<TimingWheel> wheel, asio::any_io_executor executor)
+        : entry { std::make_shared<Entry>() }
+    {
+        entry->wheel = std::move(wheel);
+        entry->executor = std::move(executor);
+    }
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+    ~Timer()
+    {
+        cancel();
+    }
+
+    void expires_after(clock::duration duration, std::function<void()> handler)
+    {
+        auto& wheel { *entry->wheel };
+        std::lock_guard guard { wheel.mutex };
+        unlink();
+        auto now { clock::now() };
+        if (!wheel.armed)
+            wheel.current = (now - wheel.origin) / TICK;
+        entry->handler = std::move(handler);
+        entry->expiry = now + duration;
+        entry->tick = std::max<std::uint64_t>((entry->expiry - wheel.origin + TICK - clock::duration { 1 }) / TICK, wheel.current + 1);
+        wheel.link(*entry);
+        entry->linked = true;
+        wheel.armed++;
+        wheel.schedule();
+    }
+    void cancel()
+    {
+        std::lock_guard guard { entry->wheel->mutex };
+        unlink();
+        entry->handler = nullptr;
+    }
+    // time_point::max() unless armed
+    auto expiry() const -> clock::time_point
+    {
+        std::lock_guard guard { entry->wheel->mutex };
+        return entry->expiry;
+    }
+};
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <array>
 #include <chrono>
+#include <cstdint>
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <ranges>
@@ -10,6 +11,7 @@
 #include <vector>
 
 #include "contest.hpp"
+#include "jsoncodec.hpp"
 #include "message.hpp"
 #include "rule.hpp"
 #include "utility.hpp"
@@ -38,8 +40,29 @@ void from_json(const nlohmann::json& j, std::optional<T>& v)
 }
 
 _EXPORT struct UiMessage : public Message {
+    // The write() members produce the same bytes as json(*this).dump(), keys in sorted order,
+    // straight into one buffer.
+    static void write_position(string& out, Position pos)
+    {
+        out += R"({"x":)";
+        json_codec::write_int(out, pos.x);
+        out += R"(,"y":)";
+        json_codec::write_int(out, pos.y);
+        out += '}';
+    }
     struct DynamicStatistics {
         string id, name, value;
+        void write(string& out) const
+        {
+            out += R"({"id":)";
+            json_codec::write_string(out, id);
+            out += R"(,"name":)";
+            json_codec::write_string(out, name);
+            out += R"(,"value":)";
+            json_codec::write_string(out, value);
+            out += '}';
+        }
+        bool operator==(const DynamicStatistics&) const = default;
         NLOHMANN_DEFINE_TYPE_INTRUSIVE(DynamicStatistics, id, name, value)
     };
     struct PlayerData {
@@ -53,6 +76,19 @@ _EXPORT struct UiMessage : public Message {
             , chess_type(player.role.id)
         {
         }
+        void write(string& out) const
+        {
+            out += R"({"avatar":)";
+            json_codec::write_string(out, avatar);
+            out += R"(,"chess_type":)";
+            json_codec::write_int(out, chess_type);
+            out += R"(,"name":)";
+            json_codec::write_string(out, name);
+            out += R"(,"type":)";
+            json_codec::write_int(out, std::to_underlying(type));
+            out += '}';
+        }
+        bool operator==(const PlayerData&) const = default;
         NLOHMANN_DEFINE_TYPE_INTRUSIVE(PlayerData, name, avatar, type, chess_type)
     };
     struct GameMetadata {
@@ -67,6 +103,19 @@ _EXPORT struct UiMessage : public Message {
             , turn_timeout(contest.duration.count())
         {
         }
+        void write(string& out) const
+        {
+            out += R"({"player_opposing":)";
+            player_opposing.write(out);
+            out += R"(,"player_our":)";
+            player_our.write(out);
+            out += R"(,"size":)";
+            json_codec::write_int(out, size);
+            out += R"(,"turn_timeout":)";
+            json_codec::write_int(out, turn_timeout);
+            out += '}';
+        }
+        bool operator==(const GameMetadata&) const = default;
         NLOHMANN_DEFINE_TYPE_INTRUSIVE(GameMetadata, size, player_opposing, player_our, turn_timeout)
     };
     struct GameResult {
@@ -78,6 +127,15 @@ _EXPORT struct UiMessage : public Message {
             , win_type(contest.result.win_type)
         {
         }
+        void write(string& out) const
+        {
+            out += R"({"win_type":)";
+            json_codec::write_int(out, std::to_underlying(win_type));
+            out += R"(,"winner":)";
+            json_codec::write_int(out, winner);
+            out += '}';
+        }
+        bool operator==(const GameResult&) const = default;
         NLOHMANN_DEFINE_TYPE_INTRUSIVE(GameResult, winner, win_type)
     };
     struct Game {
@@ -94,7 +152,7 @@ _EXPORT struct UiMessage : public Message {
         std::string encoded;
         bool is_replaying;
         Game() = default;
-        Game(const Contest& contest)
+        Game(const Contest& contest, std::vector<DynamicStatistics> statistics = {})
             : now_playing(contest.current.role.id)
             , move_count(contest.round())
             , metadata(GameMetadata(contest))
@@ -104,21 +162,62 @@ _EXPORT struct UiMessage : public Message {
             , encoded { contest.encode() }
             , is_replaying(contest.is_replaying)
             , should_giveup(contest.should_giveup)
+            , statistics(std::move(statistics))
         {
-            auto rank = contest.current.board->get_rank();
-            auto actions = contest.current.available_actions();
-            auto index = contest.current.board->index();
-            disabled_positions = index
-                | ranges::views::filter([&](auto pos) { return !(*contest.current.board)[pos] && std::find(actions.begin(), actions.end(), pos) == actions.end(); })
-                | ranges::to<std::vector>();
-            const auto board = contest.current.board->to_2dvector();
-            chessboard.resize(rank);
-            for (int i = 0; i < rank; ++i) {
-                chessboard[i].resize(rank);
-                for (int j = 0; j < rank; ++j) {
-                    chessboard[i][j] = board[i][j].id;
-                }
+            auto& view { contest.ui_view() };
+            chessboard = view.chessboard;
+            disabled_positions = view.disabled_positions;
+        }
+
+        void write_statistics(string& out) const
+        {
+            out += '[';
+            for (auto& s : statistics) {
+                if (&s != &statistics.front())
+                    out += ',';
+                s.write(out);
             }
+            out += ']';
+        }
+        void write(string& out) const
+        {
+            auto write_list = [&](auto& list, auto&& write_item) {
+                out += '[';
+                for (auto& item : list) {
+                    if (&item != &list.front())
+                        out += ',';
+                    write_item(item);
+                }
+                out += ']';
+            };
+            out += R"({"chessboard":)";
+            write_list(chessboard, [&](auto& row) { write_list(row, [&](int cell) { json_codec::write_int(out, cell); }); });
+            out += R"(,"disabled_positions":)";
+            write_list(disabled_positions, [&](Position pos) { write_position(out, pos); });
+            out += R"(,"encoded":)";
+            json_codec::write_string(out, encoded);
+            out += R"(,"end_time":)";
+            json_codec::write_int(out, end_time);
+            out += R"(,"is_replaying":)";
+            json_codec::write_bool(out, is_replaying);
+            out += R"(,"last_move":)";
+            if (last_move)
+                write_position(out, *last_move);
+            else
+                out += "null";
+            out += R"(,"metadata":)";
+            metadata.write(out);
+            out += R"(,"move_count":)";
+            json_codec::write_int(out, move_count);
+            out += R"(,"now_playing":)";
+            json_codec::write_int(out, now_playing);
+            out += R"(,"should_giveup":)";
+            json_codec::write_bool(out, should_giveup);
+            out += R"(,"start_time":)";
+            json_codec::write_int(out, start_time);
+            out += R"(,"statistics":)";
+            write_statistics(out);
+            out += '}';
         }
 
         NLOHMANN_DEFINE_TYPE_INTRUSIVE(Game, should_giveup, is_replaying, chessboard, now_playing, move_count, metadata, statistics, disabled_positions, last_move, start_time, end_time, encoded)
@@ -128,21 +227,182 @@ _EXPORT struct UiMessage : public Message {
         Contest::Status status;
         std::optional<Game> game;
         GameResult game_result;
-        UiState(const Contest& contest)
+        UiState(const Contest& contest, std::vector<DynamicStatistics> statistics = {})
             : is_gaming(contest.status == Contest::Status::ON_GOING)
             , status(contest.status)
-            , game(contest.status != Contest::Status::NOT_PREPARED ? std::optional<Game>(contest) : std::nullopt)
+            , game(contest.status != Contest::Status::NOT_PREPARED ? std::optional<Game>(std::in_place, contest, std::move(statistics)) : std::nullopt)
             , game_result(GameResult(contest))
         {
         }
-        auto to_string() -> string
+        void write(string& out) const
+        {
+            out += R"({"game":)";
+            if (game)
+                game->write(out);
+            else
+                out += "null";
+            out += R"(,"game_result":)";
+            game_result.write(out);
+            out += R"(,"is_gaming":)";
+            json_codec::write_bool(out, is_gaming);
+            out += R"(,"status":)";
+            json_codec::write_int(out, std::to_underlying(status));
+            out += '}';
+        }
+        auto to_string() const -> string
         {
-            return json(*this).dump();
+            string out;
+            write(out);
+            return out;
         }
+
+        // The changes from base, whose version is base_version, to this state as the data2 of
+        // UI_STATE_DELTA_OP, or nullopt if only a full snapshot can express them. Only what
+        // changed is present besides "base":
+        //   cells            [[x, y, chess type], ...] of the chessboard
+        //   enabled/disabled positions leaving or joining disabled_positions
+        //   encoded_append   the moves added to game.encoded
+        //   game             other changed members of game
+        //   game_result, is_gaming, status
+        // An empty string means nothing changed.
+        auto delta(const UiState& base, std::uint64_t base_version) const -> std::optional<string>
+        {
+            if (!game || !base.game || game->metadata.size != base.game->metadata.size
+                || game->chessboard.size() != base.game->chessboard.size())
+                return std::nullopt;
+            auto& now { *game };
+            auto& old { *base.game };
+            string out { R"({"base":)" };
+            json_codec::write_int(out, base_version);
+            auto unchanged { out.size() };
+
+            auto rank { std::ssize(now.chessboard) };
+            auto cells { out.size() };
+            for (int x = 0; x < rank; x++) {
+                for (int y = 0; y < rank; y++) {
+                    if (now.chessboard[x][y] == old.chessboard[x][y])
+                        continue;
+                    out += out.size() == cells ? R"(,"cells":[[)" : ",[";
+                    json_codec::write_int(out, x);
+                    out += ',';
+                    json_codec::write_int(out, y);
+                    out += ',';
+                    json_codec::write_int(out, now.chessboard[x][y]);
+                    out += ']';
+                }
+            }
+            if (out.size() != cells)
+                out += ']';
+
+            std::vector<bool> was_disabled(rank * rank), is_disabled(rank * rank);
+            for (auto pos : old.disabled_positions)
+                was_disabled[pos.x * rank + pos.y] = true;
+            for (auto pos : now.disabled_positions)
+                is_disabled[pos.x * rank + pos.y] = true;
+            // positions of from whose flag in other is not set
+            auto write_difference = [&](const char* key, auto& from, auto& other) {
+                auto start { out.size() };
+                for (auto pos : from) {
+                    if (other[pos.x * rank + pos.y])
+                        continue;
+                    if (out.size() == start) {
+                        out += key;
+                        out += '[';
+                    } else {
+                        out += ',';
+                    }
+                    write_position(out, pos);
+                }
+                if (out.size() != start)
+                    out += ']';
+            };
+            write_difference(R"(,"disabled":)", now.disabled_positions, was_disabled);
+            write_difference(R"(,"enabled":)", old.disabled_positions, is_disabled);
+
+            auto append { now.encoded != old.encoded && now.encoded.starts_with(old.encoded) };
+            if (append) {
+                out += R"(,"encoded_append":)";
+                json_codec::write_string(out, string_view { now.encoded }.substr(old.encoded.size()));
+            }
+
+            auto changes { out.size() };
+            auto member = [&](const char* key) {
+                out += out.size() == changes ? R"(,"game":{")" : R"(,")";
+                out += key;
+                out += R"(":)";
+            };
+            if (now.encoded != old.encoded && !append) {
+                member("encoded");
+                json_codec::write_string(out, now.encoded);
+            }
+            if (now.end_time != old.end_time) {
+                member("end_time");
+                json_codec::write_int(out, now.end_time);
+            }
+            if (now.is_replaying != old.is_replaying) {
+                member("is_replaying");
+                json_codec::write_bool(out, now.is_replaying);
+            }
+            if (now.last_move != old.last_move) {
+                member("last_move");
+                if (now.last_move)
+                    write_position(out, *now.last_move);
+                else
+                    out += "null";
+            }
+            if (now.metadata != old.metadata) {
+                member("metadata");
+                now.metadata.write(out);
+            }
+            if (now.move_count != old.move_count) {
+                member("move_count");
+                json_codec::write_int(out, now.move_count);
+            }
+            if (now.now_playing != old.now_playing) {
+                member("now_playing");
+                json_codec::write_int(out, now.now_playing);
+            }
+            if (now.should_giveup != old.should_giveup) {
+                member("should_giveup");
+                json_codec::write_bool(out, now.should_giveup);
+            }
+            if (now.start_time != old.start_time) {
+                member("start_time");
+                json_codec::write_int(out, now.start_time);
+            }
+            if (now.statistics != old.statistics) {
+                member("statistics");
+                now.write_statistics(out);
+            }
+            if (out.size() != changes)
+                out += '}';
+
+            if (game_result != base.game_result) {
+                out += R"(,"game_result":)";
+                game_result.write(out);
+            }
+            if (is_gaming != base.is_gaming) {
+                out += R"(,"is_gaming":)";
+                json_codec::write_bool(out, is_gaming);
+            }
+            if (status != base.status) {
+                out += R"(,"status":)";
+                json_codec::write_int(out, std::to_underlying(status));
+            }
+            if (out.size() == unchanged)
+                return string {};
+            out += '}';
+            return out;
+        }
+
         NLOHMANN_DEFINE_TYPE_INTRUSIVE(UiState, is_gaming, status, game, game_result)
     };
-    UiMessage(const Contest& contest)
-        : Message(OpCode::UPDATE_UI_STATE_OP, std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()), UiState(contest).to_string())
+    UiMessage(const UiState& state)
+        : Message(OpCode::UPDATE_UI_STATE_OP, std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()), state.to_string())
+    {
+    }
+    UiMessage(const Contest& contest, std::vector<DynamicStatistics> statistics = {})
+        : UiMessage(UiState(contest, std::move(statistics)))
     {
     }
 };
\ No newline at end of file
@@ -0,0 +1,220 @@
+#pragma once
+#ifndef _EXPORT
+#define _EXPORT
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "bitboard.hpp"
+#include "rule.hpp"
+
+// Small int8-quantised value/policy network for one board rank.
+//
+// Inputs are 4 binary planes of rank * rank points (own stones, opponent stones, legal points
+// for the side to move, legal points for the opponent), index plane * rank * rank + x * rank + y.
+// Layers: inputs -> hidden1 -> hidden2 -> { value, rank * rank policy logits }. Hidden
+// activations are clamp(round(acc * scale), 0, 127); value is tanh(acc * scale) for the
+// side to move.
+//
+// File layout, little endian: u32 MAGIC, i32 rank, hidden1, hidden2, then per layer the
+// int8 weights, i32 biases and f32 per-output scales. The first layer's weights are stored
+// input-major ([inputs][hidden1]) so a set input adds one contiguous row; every other layer is
+// output-major ([outputs][inputs]).
+_EXPORT class ValueNetwork {
+public:
+    static constexpr std::uint32_t MAGIC { 0x4f474f4e }; // "NOGO"
+    static constexpr int PLANES { 4 };
+
+    struct Output {
+        double value; // in [-1, 1], for the side to move
+        std::vector<float> policy; // logits, x * rank + y
+    };
+
+    struct Layer {
+        int inputs {}, outputs {};
+        std::vector<std::int8_t> weights;
+        std::vector<std::int32_t> biases;
+        std::vector<float> scales;
+
+        void read(std::istream& is, int in, int out)
+        {
+            inputs = in, outputs = out;
+            weights.resize(std::size_t(in) * out), biases.resize(out), scales.resize(out);
+            is.read(reinterpret_cast<char*>(weights.data()), weights.size());
+            is.read(reinterpret_cast<char*>(biases.data()), biases.size() * sizeof(std::int32_t));
+            is.read(reinterpret_cast<char*>(scales.data()), scales.size() * sizeof(float));
+        }
+        void write(std::ostream& os) const
+        {
+            os.write(reinterpret_cast<const char*>(weights.data()), weights.size());
+            os.write(reinterpret_cast<const char*>(biases.data()), biases.size() * sizeof(std::int32_t));
+            os.write(reinterpret_cast<const char*>(scales.data()), scales.size() * sizeof(float));
+        }
+    };
+
+    int rank {}, hidden1 {}, hidden2 {};
+    Layer input, hidden, value, policy;
+
+    static auto load(std::istream& is) -> ValueNetwork
+    {
+        ValueNetwork network;
+        std::uint32_t magic {};
+        is.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        is.read(reinterpret_cast<char*>(&network.rank), sizeof(int));
+        is.read(reinterpret_cast<char*>(&network.hidden1), sizeof(int));
+        is.read(reinterpret_cast<char*>(&network.hidden2), sizeof(int));
+        if (!is || magic != MAGIC)
+            throw std::runtime_error { "not a value network file" };
+        if (network.rank != 9 && network.rank != 11 && network.rank != 13)
+            throw std::runtime_error { "not supported size" };
+        if (network.hidden1 <= 0 || network.hidden1 > 4096 || network.hidden2 <= 0 || network.hidden2 > 4096)
+            throw std::runtime_error { "bad value network shape" };
+        auto points { network.rank * network.rank };
+        network.input.read(is, PLANES * points, network.hidden1);
+        network.hidden.read(is, network.hidden1, network.hidden2);
+        network.value.read(is, network.hidden2, 1);
+        network.policy.read(is, network.hidden2, points);
+        if (!is)
+            throw std::runtime_error { "truncated value network" };
+        return network;
+    }
+    static auto load(const std::string& path) -> ValueNetwork
+    {
+        std::ifstream is { path, std::ios::binary };
+        if (!is)
+            throw std::runtime_error { "cannot open value network " + path };
+        return load(is);
+    }
+    void save(std::ostream& os) const
+    {
+        os.write(reinterpret_cast<const char*>(&MAGIC), sizeof(MAGIC));
+        os.write(reinterpret_cast<const char*>(&rank), sizeof(int));
+        os.write(reinterpret_cast<const char*>(&hidden1), sizeof(int));
+        os.write(reinterpret_cast<const char*>(&hidden2), sizeof(int));
+        for (auto layer : { &input, &hidden, &value, &policy })
+            layer->write(os);
+    }
+
+    // indices of the set inputs
+    auto encode(const State& state) const -> std::vector<int>
+    {
+        switch (rank) {
+        case 9:
+            return encode<9>(state);
+        case 11:
+            return encode<11>(state);
+        case 13:
+            return encode<13>(state);
+        default:
+            throw std::logic_error { "not supported size" };
+        }
+    }
+
+    auto evaluate(std::span<const State* const> states) const -> std::vector<Output>
+    {
+        auto batch { states.size() };
+        std::vector<std::uint8_t> h1(batch * hidden1), h2(batch * hidden2);
+        std::vector<std::int32_t> acc(hidden1);
+
+        for (std::size_t b = 0; b < batch; b++) {
+            if (states[b]->board->get_rank() != rank)
+                throw std::logic_error { "value network rank mismatch" };
+            std::copy(input.biases.begin(), input.biases.end(), acc.begin());
+            for (auto i : encode(*states[b])) {
+                auto row { input.weights.data() + std::size_t(i) * hidden1 };
+                for (int j = 0; j < hidden1; j++)
+                    acc[j] += row[j];
+            }
+            for (int j = 0; j < hidden1; j++)
+                h1[b * hidden1 + j] = activate(acc[j], input.scales[j]);
+        }
+        // output rows outermost, so each weight row stays in cache across the batch
+        for (int k = 0; k < hidden2; k++) {
+            for (std::size_t b = 0; b < batch; b++)
+                h2[b * hidden2 + k] = activate(hidden.biases[k] + dot(&h1[b * hidden1], &hidden.weights[std::size_t(k) * hidden1], hidden1), hidden.scales[k]);
+        }
+
+        std::vector<Output> outputs(batch);
+        for (std::size_t b = 0; b < batch; b++) {
+            auto features { &h2[b * hidden2] };
+            outputs[b].value = std::tanh((value.biases[0] + dot(features, value.weights.data(), hidden2)) * value.scales[0]);
+            outputs[b].policy.resize(policy.outputs);
+            for (int c = 0; c < policy.outputs; c++)
+                outputs[b].policy[c] = (policy.biases[c] + dot(features, &policy.weights[std::size_t(c) * hidden2], hidden2)) * policy.scales[c];
+        }
+        return outputs;
+    }
+    auto evaluate(const State& state) const -> Output
+    {
+        const State* states[] { &state };
+        return std::move(evaluate(states)[0]);
+    }
+
+private:
+    template <int Rank>
+    static auto encode(const State& state) -> std::vector<int>
+    {
+        using Layout = BitLayout<Rank>;
+        BitBoard<Rank> board { *state.board };
+        const Plane<Rank, std::uint64_t> planes[PLANES] {
+            board.stones(state.role), board.stones(-state.role),
+            board.legal_moves(state.role), board.legal_moves(-state.role)
+        };
+        std::vector<int> active;
+        active.reserve(2 * Rank * Rank);
+        for (int plane = 0; plane < PLANES; plane++) {
+            for (int x = 0; x < Rank; x++) {
+                for (int y = 0; y < Rank; y++) {
+                    auto i { Layout::index({ x, y }) };
+                    if (planes[plane].w[i / 64] >> (i % 64) & 1)
+                        active.push_back(plane * Rank * Rank + x * Rank + y);
+                }
+            }
+        }
+        return active;
+    }
+
+    static auto activate(std::int32_t acc, float scale) -> std::uint8_t
+    {
+        return std::clamp<long>(std::lround(acc * scale), 0, 127);
+    }
+
+    // activations are at most 127, so the pairwise int16 sums of maddubs cannot saturate
+    static auto dot(const std::uint8_t* a, const std::int8_t* w, int n) -> std::int32_t
+    {
+        std::int32_t sum { 0 };
+        int i { 0 };
+#if defined(__AVX2__)
+        auto acc { _mm256_setzero_si256() };
+        const auto ones { _mm256_set1_epi16(1) };
+        for (; i + 32 <= n; i += 32) {
+            auto products { _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + i))) };
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(products, ones));
+        }
+        auto half { _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)) };
+        half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+        half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+        sum = _mm_cvtsi128_si32(half);
+#endif
+        for (; i < n; i++)
+            sum += std::int32_t { a[i] } * w[i];
+        return sum;
+    }
+};
+
+_EXPORT inline std::optional<ValueNetwork> value_network;
@@ -0,0 +1,167 @@
+#pragma once
+#ifndef _EXPORT
+#define _EXPORT
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "message.hpp"
+
+// Binary framing for peers that both support it, negotiated with PROTOCOL_OP. A frame is
+//   0x00, varint payload length, payload
+// and can never be confused with a JSON line, which cannot contain a zero byte. The payload
+// is varint code, field data1, field data2, where the code is op - 200000 for the standard
+// OpCodes and op - 100000 + 64 for the extended ones, and a field is
+//   0xf0, one byte x * 13 + y    for a board position such as "E5"
+//   0xf1, varint n, n bytes      for a long string
+//   n, n bytes                   for a string of n < 0xf0 bytes
+// Varints are little-endian base 128.
+namespace wire {
+
+_EXPORT constexpr std::string_view PROTOCOL { "binary1" };
+_EXPORT constexpr char BINARY_FRAME { 0 };
+constexpr std::uint8_t POSITION_FIELD { 0xf0 }, LONG_FIELD { 0xf1 };
+constexpr int MAX_RANK { 13 };
+
+inline void append_varint(std::string& out, std::uint64_t value)
+{
+    for (; value >= 0x80; value >>= 7)
+        out += char((value & 0x7f) | 0x80);
+    out += char(value);
+}
+
+inline auto varint_size(std::uint64_t value) -> std::size_t
+{
+    std::size_t size { 1 };
+    for (; value >= 0x80; value >>= 7)
+        size++;
+    return size;
+}
+
+// the value and the number of bytes it took, or nullopt if data ends first
+inline auto read_varint(std::string_view data) -> std::optional<std::pair<std::uint64_t, std::size_t>>
+{
+    std::uint64_t value { 0 };
+    for (std::size_t i = 0; i < data.size() && i < 10; i++) {
+        value |= std::uint64_t(data[i] & 0x7f) << (7 * i);
+        if (!(data[i] & 0x80))
+            return std::pair { value, i + 1 };
+    }
+    if (data.size() >= 10)
+        throw std::runtime_error { "bad varint" };
+    return std::nullopt;
+}
+
+// x * MAX_RANK + y if s is a position in canonical form
+inline auto position_index(std::string_view s) -> std::optional<int>
+{
+    if (s.size() < 2 || s.size() > 3 || s[0] < 'A' || s[0] >= 'A' + MAX_RANK || s[1] < '1' || s[1] > '9')
+        return std::nullopt;
+    auto y { s[1] - '0' };
+    if (s.size() == 3) {
+        if (s[2] < '0' || s[2] > '9')
+            return std::nullopt;
+        y = y * 10 + s[2] - '0';
+    }
+    if (y > MAX_RANK)
+        return std::nullopt;
+    return (s[0] - 'A') * MAX_RANK + y - 1;
+}
+
+inline auto field_size(std::string_view s) -> std::size_t
+{
+    if (position_index(s))
+        return 2;
+    if (s.size() < POSITION_FIELD)
+        return 1 + s.size();
+    return 1 + varint_size(s.size()) + s.size();
+}
+
+inline void append_field(std::string& out, std::string_view s)
+{
+    if (auto index { position_index(s) }) {
+        out += char(POSITION_FIELD);
+        out += char(*index);
+    } else if (s.size() < POSITION_FIELD) {
+        out += char(s.size());
+        out += s;
+    } else {
+        out += char(LONG_FIELD);
+        append_varint(out, s.size());
+        out += s;
+    }
+}
+
+inline auto read_field(std::string_view& data) -> std::string
+{
+    if (data.empty())
+        throw std::runtime_error { "truncated binary frame" };
+    std::uint8_t tag = data[0];
+    data.remove_prefix(1);
+    std::size_t size { tag };
+    if (tag == POSITION_FIELD) {
+        if (data.empty() || std::uint8_t(data[0]) >= MAX_RANK * MAX_RANK)
+            throw std::runtime_error { "bad position field" };
+        std::uint8_t index = data[0];
+        data.remove_prefix(1);
+        return std::string(1, 'A' + index / MAX_RANK) + std::to_string(index % MAX_RANK + 1);
+    } else if (tag == LONG_FIELD) {
+        auto length { read_varint(data) };
+        if (!length)
+            throw std::runtime_error { "truncated binary frame" };
+        size = length->first;
+        data.remove_prefix(length->second);
+    } else if (tag > LONG_FIELD) {
+        throw std::runtime_error { "bad field tag" };
+    }
+    if (data.size() < size)
+        throw std::runtime_error { "truncated binary frame" };
+    std::string s { data.substr(0, size) };
+    data.remove_prefix(size);
+    return s;
+}
+
+inline auto op_code(OpCode op) -> std::uint64_t
+{
+    auto value { std::to_underlying(op) };
+    return value >= 200000 ? value - 200000 : value - 100000 + 64;
+}
+
+// appends msg as a whole frame
+_EXPORT inline void append_binary(std::string& out, const Message& msg)
+{
+    auto code { op_code(msg.op) };
+    out += BINARY_FRAME;
+    append_varint(out, varint_size(code) + field_size(msg.data1) + field_size(msg.data2));
+    append_varint(out, code);
+    append_field(out, msg.data1);
+    append_field(out, msg.data2);
+}
+
+// length of the payload and of the header before it, if data (starting after BINARY_FRAME)
+// holds the whole header
+_EXPORT inline auto read_header(std::string_view data) -> std::optional<std::pair<std::size_t, std::size_t>>
+{
+    return read_varint(data);
+}
+
+_EXPORT inline auto parse_binary(std::string_view payload) -> Message
+{
+    auto code { read_varint(payload) };
+    if (!code)
+        throw std::runtime_error { "truncated binary frame" };
+    payload.remove_prefix(code->second);
+    Message msg;
+    msg.op = OpCode(code->first < 64 ? code->first + 200000 : code->first - 64 + 100000);
+    msg.data1 = read_field(payload);
+    msg.data2 = read_field(payload);
+    return msg;
+}
+
+}
@@ -1,16 +1,26 @@
 add_rules("mode.debug", "mode.release")
 
 add_requires("asio", "nlohmann_json","spdlog","gtest", "magic_enum")
-add_requires("range-v3", "fmt")
+add_requires("range-v3", "fmt", "zlib")
 set_languages("cxxlatest")
 -- set_optimize("aggressive")
 set_optimize("fastest")
 -- set_warnings("more", "error")
 
+option("simd")
+    set_default("sse2")
+    set_showmenu(true)
+    set_values("sse2", "avx2", "avx512")
+    set_description("Vector extension for the batched playout kernel")
+option_end()
+if is_arch("x86_64", "x64", "i386", "x86") then
+    add_vectorexts("$(simd)")
+end
+
 target("nogo")
     set_kind("binary")
     add_packages("asio", "nlohmann_json","spdlog", "magic_enum", "fmt")
-    add_packages("range-v3")
+    add_packages("range-v3", "zlib")
     add_files("nogo.cpp")
     if is_plat("windows") or is_plat("mingw") then
         add_files("res.rc")
@@ -19,7 +29,15 @@ target("nogo")
 
 target("test")
     set_kind("binary")
-    add_packages("asio","spdlog","gtest")
-    add_packages("range-v3", "fmt")
+    add_packages("asio","nlohmann_json","spdlog","gtest")
+    add_packages("range-v3", "fmt", "zlib")
     add_files("test/test.cpp")
+    add_deps("nogo", "loadgen")
     set_basename("nogo-test")
+
+target("loadgen")
+    set_kind("binary")
+    add_packages("asio", "nlohmann_json", "spdlog", "magic_enum", "fmt")
+    add_packages("range-v3")
+    add_files("test/loadgen.cpp")
+    set_basename("nogo-loadgen")